@@ -13,6 +13,18 @@
 #include <regex>
 #include <limits>
 #include <set>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
 
 #include <iostream>
 
@@ -22,12 +34,29 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <linux/fs.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <libaio.h>
+#include <liburing.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 
 #include <spdlog/spdlog.h>
 #include <fmt/format.h>
+#include <alutils/string.h>
 #include <alutils/io.h>
 #include <alutils/process.h>
 #include <alutils/socket.h>
@@ -46,683 +75,4629 @@ struct alignas(aligned_buffer_size) aligned_buffer_t {
 
 ////////////////////////////////////////////////////////////////////////////////////
 #undef __CLASS__
-#define __CLASS__ "Randomizer::"
+#define __CLASS__ "BufferPool::"
+
+// I/O buffers shared by all engines, carved from a single arena reserved with
+// mmap (MAP_NORESERVE, optionally MAP_HUGETLB or madvise(MADV_HUGEPAGE)).
+// Buffers are handed out in power-of-two size classes and returned to per-class
+// free lists, so block size changes reuse memory instead of reallocating it.
+// Arena pages are first touched by the thread that acquires the buffer, which
+// keeps them local to its NUMA node. When the arena is exhausted, buffers come
+// from the heap.
+class BufferPool {
+	static constexpr size_t min_class_bits = 12; // 4 KiB
+	static constexpr size_t max_class_bits = 40;
+	static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+	static constexpr size_t default_size   = size_t(4096) * 1024 * 1024;
+
+	std::mutex mutex;
+	char*      arena       = nullptr;
+	size_t     arena_size  = 0;
+	size_t     arena_used  = 0;
+	bool       heap_warned = false;
+	std::vector<char*> free_list[max_class_bits + 1];
+
+	static uint32_t class_bits(size_t size) {
+		uint32_t bits = min_class_bits;
+		while ((size_t(1) << bits) < size)
+			bits++;
+		return bits;
+	}
 
-class Randomizer {
-	public:
-	std::random_device  rd;
-	std::mt19937        rand_eng;
-	std::mt19937_64     rand_eng64;
-	const uint32_t      ratio_precision = 1024;
-	std::unique_ptr<std::uniform_int_distribution<uint32_t>> dist_ratio;
+	void init_arena(size_t size, const string& hugepages) {
+		assert(arena == nullptr);
+		size = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+		const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
 
-	Randomizer() {
-		auto seed = rd();
-		rand_eng.seed(seed);
-		rand_eng64.seed(seed);
-		dist_ratio.reset(new std::uniform_int_distribution<uint32_t>(0, ratio_precision -1));
+		void* addr = MAP_FAILED;
+		if (hugepages == "hugetlb") { // reserves the huge pages now: mmap fails if there are not enough
+			addr = mmap(nullptr, size, PROT_READ|PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+			if (addr == MAP_FAILED)
+				spdlog::warn("buffer pool: mmap with MAP_HUGETLB failed ({}), using normal pages", strerror(errno));
+		}
+		if (addr == MAP_FAILED) {
+			addr = mmap(nullptr, size, PROT_READ|PROT_WRITE, flags | MAP_NORESERVE, -1, 0);
+			if (addr == MAP_FAILED)
+				throw std::runtime_error(fmt::format("buffer pool: mmap error: {}", strerror(errno)).c_str());
+			if (hugepages == "thp" && madvise(addr, size, MADV_HUGEPAGE) != 0)
+				spdlog::warn("buffer pool: madvise(MADV_HUGEPAGE) returned error: {}", strerror(errno));
+		}
+		arena = static_cast<char*>(addr);
+		arena_size = size;
+		arena_used = 0;
 	}
 
-	bool randomize_ratio(double ratio) {
-		return ((*dist_ratio)(rand_eng) < static_cast<uint32_t>(ratio * ratio_precision));
+	public: //---------------------------------------------------------------------
+	BufferPool() {}
+	~BufferPool() {
+		if (arena != nullptr)
+			munmap(arena, arena_size);
 	}
 
-	void randomize_buffer(char* buffer, uint64_t size, uint64_t step=1) {
-		assert(buffer != nullptr);
-		assert(size > 0);
-		assert(step > 0);
+	// Must be called before the first acquire() to change the defaults.
+	void configure(size_t size, const string& hugepages) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (arena != nullptr)
+			throw std::runtime_error("buffer pool already in use");
+		DEBUG_MSG("size={}, hugepages={}", size, hugepages);
+		init_arena(size, hugepages);
+		spdlog::info("buffer pool: {} MiB, hugepages={}", arena_size / 1024 / 1024, hugepages);
+	}
 
-		const uint64_t size_ratio = sizeof(uint64_t) / sizeof(char);
-		uint64_t size_type = size / size_ratio;
-		std::uniform_int_distribution<uint64_t> dist;
+	// Prefers the memory of a NUMA node for the arena (--numa). Must be called
+	// before the arena is used.
+	void bind(int node) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (arena == nullptr)
+			init_arena(default_size, "none");
+		unsigned long mask[16] = {0}; // up to 1024 nodes
+		mask[node / 64] |= 1UL << (node % 64);
+		if (syscall(SYS_mbind, arena, arena_size, MPOL_PREFERRED, mask, sizeof(mask) * 8, 0) != 0)
+			spdlog::warn("buffer pool: mbind to NUMA node {} returned error: {}", node, strerror(errno));
+	}
 
-		uint64_t first_i = 0;
-		if (step > 1) {
-			std::uniform_int_distribution<uint64_t> dist_step(0, step-1);
-			first_i = dist_step(rand_eng64);
+	// Returns a buffer of at least size bytes. heap is set if the buffer
+	// doesn't belong to the arena.
+	char* acquire(size_t size, size_t& class_size, bool& heap) {
+		const auto bits = class_bits(size);
+		if (bits > max_class_bits)
+			throw std::runtime_error(fmt::format("buffer pool: invalid buffer size {}", size).c_str());
+		class_size = size_t(1) << bits;
+		heap = false;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (arena == nullptr)
+			init_arena(default_size, "none");
+
+		auto& list = free_list[bits];
+		if (list.size() > 0) {
+			auto ret = list.back();
+			list.pop_back();
+			return ret;
 		}
 
-		uint64_t* b = reinterpret_cast<uint64_t*>(buffer);
-		for (uint64_t i = first_i; i < size_type; i += step) {
-			b[i] = dist(rand_eng64);
+		const size_t align = std::min(class_size, huge_page_size);
+		size_t begin = (arena_used + align - 1) & ~(align - 1);
+		if (begin + class_size <= arena_size) {
+			arena_used = begin + class_size;
+			return arena + begin;
 		}
-	}
-
-} randomizer;
-
-
-////////////////////////////////////////////////////////////////////////////////////
-#undef __CLASS__
-#define __CLASS__ "Stats::"
 
-struct Stats {
-	uint64_t blocks        = 0;
-	uint64_t blocks_read   = 0;
-	uint64_t blocks_write  = 0;
-	uint64_t KB_read  = 0;
-	uint64_t KB_write = 0;
-	Stats operator- (const Stats& val) {
-		Stats ret = *this;
-		ret.blocks       -= val.blocks;
-		ret.blocks_read  -= val.blocks_read;
-		ret.blocks_write -= val.blocks_write;
-		ret.KB_read      -= val.KB_read;
-		ret.KB_write     -= val.KB_write;
+		if (!heap_warned) {
+			spdlog::warn("buffer pool exhausted, allocating buffers from the heap (see --buffer_pool_size)");
+			heap_warned = true;
+		}
+		auto ret = static_cast<char*>(aligned_alloc(std::min(class_size, huge_page_size), class_size));
+		if (ret == nullptr)
+			throw std::runtime_error(fmt::format("buffer pool: can't allocate {} bytes", class_size).c_str());
+		heap = true;
 		return ret;
 	}
-	Stats& operator+= (const Stats& val) {
-		blocks       += val.blocks;
-		blocks_read  += val.blocks_read;
-		blocks_write += val.blocks_write;
-		KB_read      += val.KB_read;
-		KB_write     += val.KB_write;
-		return *this;
+
+	void release(char* buffer, size_t class_size, bool heap) {
+		if (heap) {
+			free(buffer);
+			return;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		free_list[class_bits(class_size)].push_back(buffer);
 	}
 };
 
-////////////////////////////////////////////////////////////////////////////////////
-#undef __CLASS__
-#define __CLASS__ "GenericEngine::"
+BufferPool buffer_pool;
 
-typedef std::function<void(const Stats& val)> increment_stats_t;
+// Buffer acquired from buffer_pool, released when reset or destroyed.
+class IOBuffer {
+	char*  data_      = nullptr;
+	size_t size_      = 0;
+	size_t class_size = 0;
+	bool   heap       = false;
 
-class GenericEngine {
 	public: //---------------------------------------------------------------------
-	GenericEngine() {}
-	virtual ~GenericEngine() {}
-	virtual void make_requests(bool& stop_) {}
-	virtual void wait() {}
-	virtual bool is_multithread() {return false;}
-};
-
-////////////////////////////////////////////////////////////////////////////////////
-#undef __CLASS__
-#define __CLASS__ "AccessParams::"
+	IOBuffer() {}
+	IOBuffer(const IOBuffer&) = delete;
+	IOBuffer& operator=(const IOBuffer&) = delete;
+	~IOBuffer() { reset(); }
+
+	void reset(size_t size = 0) {
+		if (data_ != nullptr) {
+			buffer_pool.release(data_, class_size, heap);
+			data_ = nullptr;
+			size_ = 0;
+			class_size = 0;
+		}
+		if (size > 0) {
+			data_ = buffer_pool.acquire(size, class_size, heap);
+			size_ = size;
+		}
+	}
 
-struct AccessParams {
-	typeof(Args::block_size) block_size;
-	size_t     size;
-	long long  offset;
-	bool       write;
-	bool       dsync;
+	char*  data() const { return data_; }
+	size_t size() const { return size_; }
+	size_t capacity() const { return class_size; }
 };
 
-typedef std::function<AccessParams()> access_params_t;
-typedef std::function<void(long long offset)> offset_released_t;
-
 ////////////////////////////////////////////////////////////////////////////////////
 #undef __CLASS__
-#define __CLASS__ "PosixEngine::"
-
-class PosixEngine : public GenericEngine {
-	int fd;
-
-	increment_stats_t increment_stats;
-	access_params_t access_params;
-	offset_released_t offset_released;
-
-	std::unique_ptr<aligned_buffer_t[]> buffer_mem;
-	char*      buffer = nullptr;
-	size_t     cur_size = 0;
-	long long  cur_offset = 0;
-	bool       cur_write = false;
-
-	public:  // ------------------------------------------------------------
-	PosixEngine(int fd_, increment_stats_t increment_stats_,
-	          access_params_t access_params_, offset_released_t offset_released_)
-	          : fd(fd_), increment_stats(increment_stats_),
-	            access_params(access_params_), offset_released(offset_released_)
-	{
-		DEBUG_MSG("constructor");
+#define __CLASS__ "CpuPlacement::"
+
+// Placement of the engine threads (--cpus, --numa). With --cpus, each thread
+// is pinned to one CPU of the list, in turn. With --numa, the threads may run
+// on any CPU of the node (unless --cpus is given) and the buffer pool is bound
+// to it. --numa=device takes the node of the PCI device behind the first
+// file (/sys/dev/block/<major>:<minor>).
+class CpuPlacement {
+	std::vector<int>      cpus;
+	std::vector<int>      node_cpus;
+	int                   node = -1;
+	std::atomic<uint32_t> next_cpu {0};
+
+	// "0-3,8,10-11"
+	static std::vector<int> parse_cpu_list(const string& str) {
+		std::vector<int> ret;
+		for (auto& i: alutils::split_str(str, ",")) {
+			auto range = alutils::split_str(i, "-");
+			int first = std::stoi(range[0]);
+			int last  = (range.size() > 1) ? std::stoi(range[1]) : first;
+			for (int c = first; c <= last; c++)
+				ret.push_back(c);
+		}
+		return ret;
 	}
 
-	~PosixEngine() {
-		DEBUG_MSG("destructor");
+	static string read_line(const std::filesystem::path& path) {
+		std::ifstream f(path);
+		string ret;
+		std::getline(f, ret);
+		return ret;
 	}
 
-	void make_requests(bool& stop_) {
-		if (stop_) return;
-
-		auto params = access_params();
-		assert(params.size > 0);
-		if (cur_size != params.size) {
-			DEBUG_MSG("request size changed from {} to {}", cur_size, params.size);
-			cur_size = params.size;
-			buffer_mem.reset(new aligned_buffer_t[cur_size/sizeof(aligned_buffer_t)]);
-			buffer = buffer_mem[0].data;
-			randomizer.randomize_buffer(buffer, cur_size);
-		} else if (params.write && cur_write) { // randomize 5% of the buffer due to repeated writes
-			randomizer.randomize_buffer(buffer, cur_size, 20);
+	// NUMA node of the device of a file or block device, -1 if unknown.
+	static int device_node(const string& filename) {
+		struct stat st;
+		if (stat(filename.c_str(), &st) != 0) { // --create_file: the directory
+			auto dir = std::filesystem::path(filename).parent_path();
+			if (stat(dir.empty() ? "." : dir.c_str(), &st) != 0)
+				throw std::runtime_error(fmt::format("can't find the device of {}: {}", filename, strerror(errno)).c_str());
+		}
+		dev_t dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+
+		std::error_code ec;
+		auto path = std::filesystem::canonical(fmt::format("/sys/dev/block/{}:{}", major(dev), minor(dev)), ec);
+		if (ec) return -1;
+		if (std::filesystem::exists(path / "partition"))
+			path = path.parent_path();
+		for (auto& p: {path / "device" / "numa_node", path / "device" / "device" / "numa_node"}) { // nvme: controller, then PCI
+			auto value = read_line(p);
+			if (value != "")
+				return std::stoi(value);
 		}
+		return -1;
+	}
 
-		auto stats = Stats{
-			.blocks = 1,
-			.blocks_read  = static_cast<uint64_t>( (!params.write) ? 1 : 0 ),
-			.blocks_write = static_cast<uint64_t>( ( params.write) ? 1 : 0 ),
-			.KB_read  = (!params.write) ? params.block_size : 0,
-			.KB_write = ( params.write) ? params.block_size : 0,
-		};
+	static string cpus_str(const cpu_set_t& set) {
+		string ret;
+		for (int c = 0; c < CPU_SETSIZE; c++) {
+			if (CPU_ISSET(c, &set))
+				ret += fmt::format("{}{}", ret.length() > 0 ? "," : "", c);
+		}
+		return ret;
+	}
 
-		if (cur_offset + cur_size != params.offset) {
-			if (lseek(fd, params.offset, SEEK_SET) == -1)
-				throw std::runtime_error(fmt::format("seek error: {}", strerror(errno)).c_str());
+	public: //---------------------------------------------------------------------
+	void configure(const string& cpus_, const string& numa, const std::vector<string>& filenames) {
+		DEBUG_MSG("cpus={}, numa={}", cpus_, numa);
+		cpus = parse_cpu_list(cpus_);
+
+		if (numa == "device") {
+			node = device_node(filenames[0]);
+			for (auto& f: filenames) {
+				if (device_node(f) != node)
+					spdlog::warn("the files are in devices of different NUMA nodes, using the node of {}", filenames[0]);
+			}
+			if (node < 0)
+				spdlog::warn("can't find the NUMA node of the device of {}, threads and buffers are not placed", filenames[0]);
+		} else if (numa != "none") {
+			node = std::stoi(numa);
 		}
-		cur_offset = params.offset;
-		cur_write = params.write;
 
-		if (stop_) return;
+		if (node >= 0) {
+			node_cpus = parse_cpu_list(read_line(fmt::format("/sys/devices/system/node/node{}/cpulist", node)));
+			if (node_cpus.size() == 0)
+				throw std::runtime_error(fmt::format("invalid NUMA node {}", node).c_str());
+			spdlog::info("NUMA node {} (cpus {})", node, read_line(fmt::format("/sys/devices/system/node/node{}/cpulist", node)));
+			buffer_pool.bind(node);
+		}
+	}
 
-		if (params.write) {
-			if (write(fd, buffer, cur_size) == -1)
-				throw std::runtime_error(fmt::format("write error: {}", strerror(errno)).c_str());
+	// Pins the calling thread and reports its placement.
+	void pin(const string& thread_name) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (cpus.size() > 0) {
+			CPU_SET(cpus[next_cpu++ % cpus.size()], &set);
+		} else if (node_cpus.size() > 0) {
+			for (auto c: node_cpus)
+				CPU_SET(c, &set);
 		} else {
-			if (read(fd, buffer, cur_size) == -1)
-				throw std::runtime_error(fmt::format("read error: {}", strerror(errno)).c_str());
+			return;
 		}
-
-		offset_released(cur_offset);
-		increment_stats(stats);
+		auto ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (ret != 0)
+			throw std::runtime_error(fmt::format("can't set the CPU affinity of thread {}: {}", thread_name, strerror(ret)).c_str());
+		spdlog::info("placement: thread {} on cpu {} (node {})", thread_name, cpus_str(set), node);
 	}
 };
 
+CpuPlacement cpu_placement;
+
 ////////////////////////////////////////////////////////////////////////////////////
 #undef __CLASS__
-#define __CLASS__ "AIORequest::"
-
-class AIORequest {
-	public:  // ------------------------------------------------------------
-	struct Options {
-		int                 pos_count = 0;
-		int                 fd;
-		io_context_t*       ctx;
-		access_params_t     access_params;
-		offset_released_t   offset_released;
+#define __CLASS__ "CpuAccounting::"
+
+/*_f(CPU_STAT_name)*/
+#define ALL_CPU_STATS_F( _f ) \
+	_f(user_us)               \
+	_f(sys_us)                \
+	_f(ctx_voluntary)         \
+	_f(ctx_involuntary)       \
+	_f(task_clock_ns)         \
+	_f(ctx_switches)          \
+	_f(cycles)                \
+	_f(instructions)          \
+	_f(io_threads_us)
+
+struct CpuStats {
+#	define declareStat(STAT_name) uint64_t STAT_name = 0;
+	ALL_CPU_STATS_F( declareStat )
+#	undef declareStat
+
+	CpuStats operator- (const CpuStats& val) const {
+		CpuStats ret = *this;
+#		define subStat(STAT_name) ret.STAT_name -= val.STAT_name;
+		ALL_CPU_STATS_F( subStat )
+#		undef subStat
+		return ret;
+	}
+	CpuStats& operator+= (const CpuStats& val) {
+#		define addStat(STAT_name) STAT_name += val.STAT_name;
+		ALL_CPU_STATS_F( addStat )
+#		undef addStat
+		return *this;
+	}
+};
 
-		Options(int fd_, io_context_t* ctx_, access_params_t access_params_,
-		        offset_released_t offset_released_)
-		        : fd(fd_), ctx(ctx_),
-				  access_params(access_params_),
-				  offset_released(offset_released_) {}
+// CPU usage of the engine threads (--cpu_stats): the controller thread and
+// the aio, prwv2 and flusher workers. Each thread registers itself for its
+// whole life. Live threads are sampled from /proc/self/task/<tid> (clock tick
+// resolution), finished ones add their getrusage(RUSAGE_THREAD) to the
+// totals. With --cpu_stats=perf, each thread also opens its own counters
+// (task-clock, context-switches, cycles, instructions), which any thread can
+// read. Counters refused by the kernel (perf_event_paranoid, no PMU in VMs)
+// are left at 0.
+// The kernel threads that io_uring creates in this process (iou-sqp-* for
+// SQPOLL, iou-wrk-* for io-wq) are found in /proc/self/task at every snapshot
+// and added to the totals and to io_threads_us. Their last sample is kept
+// when they exit. They have no perf counters.
+class CpuAccounting {
+	enum PerfCounter {task_clock, ctx_switches, cycles, instructions, n_perf_counters};
+
+	struct ThreadInfo {
+		string name;
+		pid_t  tid;
+		int    perf_fd[n_perf_counters];
 	};
 
-	Options*         options;
-	int              pos    = -1;
-	bool             active = false;
-	bool             write  = false;
-	iocb             cb;
-	Stats            stats;
-	size_t           size   = 0;
-	long long        offset = 0;
+	bool     rusage_enabled = false;
+	bool     perf_enabled   = false;
+	std::atomic<bool> perf_warned {false};
+	uint64_t clock_tick_us  = 1;
+
+	std::mutex                              mutex;
+	std::deque<std::unique_ptr<ThreadInfo>> threads;
+	CpuStats                                finished;
+	std::map<pid_t, CpuStats>               io_threads; // last sample of the live ones
+	CpuStats                                io_threads_finished;
+
+	void open_perf(ThreadInfo& t) {
+		static const char* name[n_perf_counters] = {"task-clock", "context-switches", "cycles", "instructions"};
+		static const std::pair<uint32_t, uint64_t> config[n_perf_counters] = {
+			{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+			{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS}};
+		for (uint32_t i = 0; i < n_perf_counters; i++) {
+			t.perf_fd[i] = -1;
+			if (!perf_enabled) continue;
+			perf_event_attr pe;
+			memset(&pe, 0, sizeof(pe));
+			pe.size        = sizeof(pe);
+			pe.type        = config[i].first;
+			pe.config      = config[i].second;
+			pe.exclude_hv  = 1;
+			pe.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			t.perf_fd[i] = syscall(SYS_perf_event_open, &pe, 0, -1, -1, PERF_FLAG_FD_CLOEXEC); // this thread, any cpu
+			if (t.perf_fd[i] < 0 && !perf_warned.exchange(true))
+				spdlog::warn("cpu_stats: perf counter {} of thread {} not available: {}", name[i], t.name, strerror(errno));
+		}
+	}
 
-	std::unique_ptr<aligned_buffer_t[]> buffer_mem;
-	char*            buffer = nullptr;
+	// counter value scaled by the time it was scheduled in the PMU
+	static uint64_t read_perf(int fd) {
+		if (fd < 0) return 0;
+		uint64_t v[3]; // value, time enabled, time running
+		if (read(fd, v, sizeof(v)) != sizeof(v) || v[2] == 0) return 0;
+		return (v[1] == v[2]) ? v[0] : static_cast<uint64_t>(static_cast<double>(v[0]) * static_cast<double>(v[1]) / static_cast<double>(v[2]));
+	}
 
-	AIORequest(Options* options_) : options(options_) {
-		assert( options != nullptr );
-		pos = options->pos_count++;
+	static void add_perf(const ThreadInfo& t, CpuStats& ret) {
+		ret.task_clock_ns += read_perf(t.perf_fd[task_clock]);
+		ret.ctx_switches  += read_perf(t.perf_fd[ctx_switches]);
+		ret.cycles        += read_perf(t.perf_fd[cycles]);
+		ret.instructions  += read_perf(t.perf_fd[instructions]);
 	}
 
-	~AIORequest() {
-		if (active) {
-			spdlog::info("AIORequest[{}] is still active. Canceling it.", pos);
-			io_event event;
-			auto ret = io_cancel(*(options->ctx), &cb, &event);
-			if (ret < 0) {
-				spdlog::warn("\tio_cancel returned error {}:{}", ret, E2S(ret));
-			}
+	// rusage of another thread of this process. Returns false if it finished.
+	bool add_proc(pid_t tid, CpuStats& ret) const {
+		std::ifstream stat(fmt::format("/proc/self/task/{}/stat", tid));
+		string line;
+		std::getline(stat, line);
+		auto pos = line.rfind(')'); // the name may contain spaces
+		if (pos == string::npos) return false; // thread finished meanwhile
+		auto fields = alutils::split_str(line.substr(pos + 2), " "); // from field 3 (state)
+		if (fields.size() < 13) return false;
+		ret.user_us += std::stoull(fields[11]) * clock_tick_us; // field 14: utime
+		ret.sys_us  += std::stoull(fields[12]) * clock_tick_us; // field 15: stime
+
+		std::ifstream status(fmt::format("/proc/self/task/{}/status", tid));
+		while (std::getline(status, line)) {
+			auto aux = alutils::split_str(line, ":");
+			if (aux.size() < 2) continue;
+			if (aux[0] == "voluntary_ctxt_switches")
+				ret.ctx_voluntary += std::stoull(aux[1]);
+			else if (aux[0] == "nonvoluntary_ctxt_switches")
+				ret.ctx_involuntary += std::stoull(aux[1]);
 		}
+		return true;
 	}
 
-	bool request() {
-		assert(pos >= 0);
-		assert(!active);
+	// Samples the io_uring kernel threads. Called with mutex.
+	void sample_io_threads() {
+		std::set<pid_t> seen;
+		std::error_code ec;
+		for (auto& entry: std::filesystem::directory_iterator("/proc/self/task", ec)) {
+			pid_t tid = std::atoi(entry.path().filename().c_str());
+			string comm;
+			std::ifstream f(entry.path() / "comm");
+			if (!std::getline(f, comm) || (comm.rfind("iou-sqp", 0) != 0 && comm.rfind("iou-wrk", 0) != 0))
+				continue;
+			CpuStats aux;
+			if (!add_proc(tid, aux))
+				continue;
+			aux.io_threads_us = aux.user_us + aux.sys_us;
+			if (io_threads.count(tid) == 0)
+				DEBUG_MSG("io_uring thread {} (tid {})", comm, tid);
+			io_threads[tid] = aux;
+			seen.insert(tid);
+		}
+		for (auto i = io_threads.begin(); i != io_threads.end(); ) {
+			if (seen.count(i->first) == 0) {
+				io_threads_finished += i->second;
+				i = io_threads.erase(i);
+			} else {
+				i++;
+			}
+		}
+	}
 
-		auto params = options->access_params();
-		assert(params.size > 0);
-		if (size != params.size) {
-			DEBUG_MSG("request size changed from {} to {}", size, params.size);
-			size = params.size;
-			buffer_mem.reset(new aligned_buffer_t[size/sizeof(aligned_buffer_t)]);
-			buffer = buffer_mem[0].data;
-			randomizer.randomize_buffer(buffer, size);
-		} else if (params.write && write) { // randomize 5% of the buffer due to repeated writes
-			randomizer.randomize_buffer(buffer, size, 20);
+	public: //---------------------------------------------------------------------
+	// Unregisters the thread when it finishes.
+	class Guard {
+		CpuAccounting* owner;
+		ThreadInfo*    info;
+		public:
+		Guard(CpuAccounting* owner_, ThreadInfo* info_) : owner(owner_), info(info_) {}
+		Guard(const Guard&) = delete;
+		~Guard() {
+			if (info != nullptr)
+				owner->unregister_thread(info);
 		}
+	};
 
-		stats = Stats{
-			.blocks = 1,
-			.blocks_read  = static_cast<uint64_t>( (!params.write) ? 1 : 0 ),
-			.blocks_write = static_cast<uint64_t>( ( params.write) ? 1 : 0 ),
-			.KB_read  = (!params.write) ? params.block_size : 0,
-			.KB_write = ( params.write) ? params.block_size : 0,
-		};
+	void configure(const string& method) {
+		DEBUG_MSG("method={}", method);
+		rusage_enabled = (method != "none");
+		perf_enabled   = (method == "perf");
+		clock_tick_us  = 1000000 / sysconf(_SC_CLK_TCK);
+	}
 
-		write = params.write;
-		offset = params.offset;
+	bool enabled() const { return rusage_enabled; }
+	bool perf() const { return perf_enabled; }
+
+	// Must be called by the thread being registered.
+	Guard register_thread(const string& name) {
+		if (!rusage_enabled)
+			return Guard(this, nullptr);
+		std::unique_ptr<ThreadInfo> t(new ThreadInfo{name, static_cast<pid_t>(syscall(SYS_gettid)), {}});
+		open_perf(*t);
+		DEBUG_MSG("thread {} (tid {})", name, t->tid);
+		std::lock_guard<std::mutex> lock(mutex);
+		threads.emplace_back(std::move(t));
+		return Guard(this, threads.back().get());
+	}
 
-		if (params.write) {
-			io_prep_pwrite(&cb, options->fd, buffer, size, offset);
-			if (params.dsync) {
-				cb.aio_rw_flags |= RWF_DSYNC;
-			}
-		} else { //read
-			io_prep_pread(&cb, options->fd, buffer, size, offset);
+	// Called by the registered thread.
+	void unregister_thread(ThreadInfo* t) {
+		CpuStats aux;
+		rusage ru;
+		if (getrusage(RUSAGE_THREAD, &ru) == 0) {
+			aux.user_us         = ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec;
+			aux.sys_us          = ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
+			aux.ctx_voluntary   = ru.ru_nvcsw;
+			aux.ctx_involuntary = ru.ru_nivcsw;
+		}
+		add_perf(*t, aux);
+		for (auto fd: t->perf_fd) {
+			if (fd >= 0) close(fd);
 		}
-		cb.data = this;
 
-		iocb* iocbs[] = {&cb};
-		auto ret = io_submit(*(options->ctx), 1, iocbs);
-		if (ret == 1) {
-			active = true;
-			return true;
-		} else if (ret == 0) {
-			spdlog::warn("aio submit returned 0");
-		} else if (ret == -EINTR || ret == -EAGAIN) {
-			spdlog::warn("aio submit returned {}:{}", ret, E2S(ret));
-		} else {
-			throw std::runtime_error(fmt::format("failed to submit the aio request: {}:{}", ret, E2S(ret)).c_str());
+		std::lock_guard<std::mutex> lock(mutex);
+		finished += aux;
+		for (auto i = threads.begin(); i != threads.end(); i++) {
+			if (i->get() == t) {
+				threads.erase(i);
+				break;
+			}
 		}
-		return false;
 	}
 
-	void request_finished() {
-		assert(active);
-		active = false;
-		options->offset_released(offset);
+	void snapshot(CpuStats& ret) {
+		if (!rusage_enabled) return;
+		std::lock_guard<std::mutex> lock(mutex);
+		ret = finished;
+		for (auto& t: threads) {
+			add_proc(t->tid, ret);
+			add_perf(*t, ret);
+		}
+		sample_io_threads();
+		ret += io_threads_finished;
+		for (auto& i: io_threads)
+			ret += i.second;
 	}
 };
 
+CpuAccounting cpu_accounting;
+
 ////////////////////////////////////////////////////////////////////////////////////
 #undef __CLASS__
-#define __CLASS__ "AIOEngine::"
-
-class AIOEngine : public GenericEngine {
-	io_context_t ctx;
+#define __CLASS__ "Xoshiro256::"
 
-	std::unique_ptr<AIORequest::Options> request_options;
-	std::unique_ptr<std::unique_ptr<AIORequest>[]> request_list;
+// xoshiro256** 1.0 (https://prng.di.unimi.it/), usable with the <random>
+// distributions. jump() and long_jump() advance the state by 2^128 and 2^192
+// steps, which gives non-overlapping streams to threads and SIMD lanes.
+class Xoshiro256 {
+	uint64_t s[4];
 
-	uint32_t& iodepth;
-	increment_stats_t increment_stats;
+	static inline uint64_t rotl(const uint64_t x, int k) {
+		return (x << k) | (x >> (64 - k));
+	}
 
-	public:  // ------------------------------------------------------------
-	AIOEngine(int fd, uint32_t& iodepth_, increment_stats_t increment_stats_,
-	          access_params_t access_params_, offset_released_t offset_released_)
-	          : iodepth(iodepth_), increment_stats(increment_stats_)
-	{
-		DEBUG_MSG("constructor");
+	void jump(const uint64_t (&table)[4]) {
+		uint64_t t[4] = {0, 0, 0, 0};
+		for (auto j: table) {
+			for (int b = 0; b < 64; b++) {
+				if (j & (UINT64_C(1) << b)) {
+					for (int i = 0; i < 4; i++)
+						t[i] ^= s[i];
+				}
+				(*this)();
+			}
+		}
+		for (int i = 0; i < 4; i++)
+			s[i] = t[i];
+	}
 
-		memset(&ctx, 0, sizeof(ctx));
-		auto ret = io_setup(max_iodepth, &ctx);
-		if (ret != 0) {
-			throw std::runtime_error(fmt::format("io_setup returned error {}:{}", ret, E2S(ret)).c_str());
+	public: //---------------------------------------------------------------------
+	typedef uint64_t result_type;
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+	Xoshiro256(uint64_t seed = 0) { this->seed(seed); }
+
+	void seed(uint64_t value) { // splitmix64, as recommended by the authors
+		for (int i = 0; i < 4; i++) {
+			uint64_t z = (value += UINT64_C(0x9e3779b97f4a7c15));
+			z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+			z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+			s[i] = z ^ (z >> 31);
 		}
+	}
 
-		request_options.reset(new AIORequest::Options(fd, &ctx, access_params_, offset_released_));
+	inline result_type operator()() {
+		const uint64_t result = rotl(s[1] * 5, 7) * 9;
+		const uint64_t t = s[1] << 17;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = rotl(s[3], 45);
+		return result;
+	}
 
-		request_list.reset(new std::unique_ptr<AIORequest>[max_iodepth]);
-		for (int i = 0; i < max_iodepth; i++) {
-			request_list[i].reset(new AIORequest(request_options.get()));
-		}
+	void jump() {
+		static const uint64_t table[4] = { 0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 0xa9582618e03fc9aa, 0x39abdc4529b1661c };
+		jump(table);
 	}
 
-	~AIOEngine() {
-		DEBUG_MSG("destructor");
+	void long_jump() {
+		static const uint64_t table[4] = { 0x76e15d3efefdcbbf, 0xc5004e441c522fb3, 0x77710069854ee241, 0x39109bb02acbe635 };
+		jump(table);
+	}
 
-		spdlog::info("waiting for pending requests");
-		timespec timeout = {.tv_sec  = 0, .tv_nsec = 300 * 1000 * 1000 };
-		io_event events[max_iodepth];
-		auto ret = io_getevents(ctx, iodepth, max_iodepth, events, &timeout);
-		if (ret < 0) {
-			spdlog::error("io_getevents returned error {}:{}", ret, E2S(ret));
-		}
-		for (int i = 0; i < ret; i++)
-			request_list[i]->active = false;
+	uint64_t state(int i) const { return s[i]; }
+};
 
-		DEBUG_MSG("removing request_list");
-		request_list.reset(nullptr);
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "Randomizer::"
 
-		DEBUG_MSG("io_destroy(ctx)");
-		ret = io_destroy(ctx);
-		if (ret < 0) {
-			spdlog::error("io_destroy returned error {}:{}", ret, E2S(ret));
-		}
+// One instance per thread (see randomizer below). Each thread's generator
+// starts 2^192 steps after the previous one, taken from a shared seeder.
+class Randomizer {
+	static constexpr int simd_lanes = 4;
+
+	// state of simd_lanes interleaved xoshiro256** streams: vstate[word][lane]
+	alignas(32) uint64_t vstate[4][simd_lanes];
+
+	static Xoshiro256 next_thread_engine() {
+		static std::mutex seeder_mutex;
+		static Xoshiro256 seeder(std::random_device{}() | (static_cast<uint64_t>(std::random_device{}()) << 32));
+		std::lock_guard<std::mutex> lock(seeder_mutex);
+		Xoshiro256 ret = seeder;
+		seeder.long_jump();
+		return ret;
 	}
 
-	void make_requests(bool& stop_) {
-		for (int i = 0; i < iodepth; i++ ){
-			if (! request_list[i]->active) {
-				request_list[i]->request();
-			}
+	public:
+	Xoshiro256          rand_eng;
+	const uint32_t      ratio_precision_bits = 10;
+	const uint32_t      ratio_precision = 1 << ratio_precision_bits;
+
+	Randomizer() : rand_eng(next_thread_engine()) {
+		Xoshiro256 lane = rand_eng;
+		for (int l = 0; l < simd_lanes; l++) {
+			lane.jump();
+			for (int w = 0; w < 4; w++)
+				vstate[w][l] = lane.state(w);
 		}
+	}
 
-		if (stop_) return;
-
-		timespec timeout = {.tv_sec  = 0, .tv_nsec = 200 * 1000 * 1000 };
-		io_event events[max_iodepth];
+	bool randomize_ratio(double ratio) {
+		return ((rand_eng() >> (64 - ratio_precision_bits)) < static_cast<uint32_t>(ratio * ratio_precision));
+	}
 
-		auto nevents = io_getevents(ctx, 1, max_iodepth, events, &timeout);
+	// uniform integer in [0, n) (Lemire's multiply-shift, no division)
+	inline uint64_t uniform(uint64_t n) {
+		return static_cast<uint64_t>((static_cast<unsigned __int128>(rand_eng()) * n) >> 64);
+	}
 
-		if (stop_) return;
+	// uniform double in [0, 1)
+	inline double uniform_real() {
+		return static_cast<double>(rand_eng() >> 11) * 0x1.0p-53;
+	}
 
-		if (nevents < 0) {
-			if (nevents != -EAGAIN && nevents != -EINTR) {
-				spdlog::warn("io_getevents returned {}:{}", nevents, E2S(nevents));
+	void randomize_buffer(char* buffer, uint64_t size, uint64_t step=1) {
+		assert(buffer != nullptr);
+		assert(size > 0);
+		assert(step > 0);
+
+		const uint64_t size_ratio = sizeof(uint64_t) / sizeof(char);
+		uint64_t size_type = size / size_ratio;
+		uint64_t* b = reinterpret_cast<uint64_t*>(buffer);
+
+		if (step == 1) {
+			fill_buffer(b, size_type);
+			return;
+		}
+
+		for (uint64_t i = uniform(step); i < size_type; i += step) {
+			b[i] = rand_eng();
+		}
+	}
+
+	private: //--------------------------------------------------------------------
+
+	void fill_buffer(uint64_t* b, uint64_t n) {
+		uint64_t done = 0;
+#		if defined(__x86_64__)
+		static const bool has_avx2 = __builtin_cpu_supports("avx2");
+		if (has_avx2)
+			done = fill_buffer_avx2(b, n);
+		else
+			done = fill_buffer_sse2(b, n);
+#		endif
+		for (uint64_t i = done; i < n; i++) {
+			b[i] = rand_eng();
+		}
+	}
+
+#	if defined(__x86_64__)
+	// x*5 == (x<<2)+x, x*9 == (x<<3)+x: SSE2/AVX2 have no 64-bit multiply
+	__attribute__((target("avx2")))
+	uint64_t fill_buffer_avx2(uint64_t* b, uint64_t n) {
+		__m256i s0 = _mm256_load_si256(reinterpret_cast<const __m256i*>(vstate[0]));
+		__m256i s1 = _mm256_load_si256(reinterpret_cast<const __m256i*>(vstate[1]));
+		__m256i s2 = _mm256_load_si256(reinterpret_cast<const __m256i*>(vstate[2]));
+		__m256i s3 = _mm256_load_si256(reinterpret_cast<const __m256i*>(vstate[3]));
+		uint64_t i = 0;
+		for (; i + 4 <= n; i += 4) {
+			__m256i x = _mm256_add_epi64(_mm256_slli_epi64(s1, 2), s1);
+			x = _mm256_or_si256(_mm256_slli_epi64(x, 7), _mm256_srli_epi64(x, 57));
+			x = _mm256_add_epi64(_mm256_slli_epi64(x, 3), x);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(b + i), x);
+
+			__m256i t = _mm256_slli_epi64(s1, 17);
+			s2 = _mm256_xor_si256(s2, s0);
+			s3 = _mm256_xor_si256(s3, s1);
+			s1 = _mm256_xor_si256(s1, s2);
+			s0 = _mm256_xor_si256(s0, s3);
+			s2 = _mm256_xor_si256(s2, t);
+			s3 = _mm256_or_si256(_mm256_slli_epi64(s3, 45), _mm256_srli_epi64(s3, 19));
+		}
+		_mm256_store_si256(reinterpret_cast<__m256i*>(vstate[0]), s0);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(vstate[1]), s1);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(vstate[2]), s2);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(vstate[3]), s3);
+		return i;
+	}
+
+	uint64_t fill_buffer_sse2(uint64_t* b, uint64_t n) { // uses lanes 0 and 1
+		__m128i s0 = _mm_load_si128(reinterpret_cast<const __m128i*>(vstate[0]));
+		__m128i s1 = _mm_load_si128(reinterpret_cast<const __m128i*>(vstate[1]));
+		__m128i s2 = _mm_load_si128(reinterpret_cast<const __m128i*>(vstate[2]));
+		__m128i s3 = _mm_load_si128(reinterpret_cast<const __m128i*>(vstate[3]));
+		uint64_t i = 0;
+		for (; i + 2 <= n; i += 2) {
+			__m128i x = _mm_add_epi64(_mm_slli_epi64(s1, 2), s1);
+			x = _mm_or_si128(_mm_slli_epi64(x, 7), _mm_srli_epi64(x, 57));
+			x = _mm_add_epi64(_mm_slli_epi64(x, 3), x);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(b + i), x);
+
+			__m128i t = _mm_slli_epi64(s1, 17);
+			s2 = _mm_xor_si128(s2, s0);
+			s3 = _mm_xor_si128(s3, s1);
+			s1 = _mm_xor_si128(s1, s2);
+			s0 = _mm_xor_si128(s0, s3);
+			s2 = _mm_xor_si128(s2, t);
+			s3 = _mm_or_si128(_mm_slli_epi64(s3, 45), _mm_srli_epi64(s3, 19));
+		}
+		_mm_store_si128(reinterpret_cast<__m128i*>(vstate[0]), s0);
+		_mm_store_si128(reinterpret_cast<__m128i*>(vstate[1]), s1);
+		_mm_store_si128(reinterpret_cast<__m128i*>(vstate[2]), s2);
+		_mm_store_si128(reinterpret_cast<__m128i*>(vstate[3]), s3);
+		return i;
+	}
+#	endif
+};
+
+thread_local Randomizer randomizer;
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "DataPattern::"
+
+// Content of the write buffers with a target compression ratio and dedup ratio
+// (--compress_ratio, --dedup_ratio). Buffers are built from 4 KiB chunks made of
+// 512-byte segments, each one with 512/compress_ratio random bytes followed by
+// zeros, so codecs with small and large windows compress them alike. All chunks
+// are copies from a pregenerated pool, so the writes only cost a memcpy. A chunk
+// is unique with probability 1/dedup_ratio: a small random stamp at the end of
+// the random bytes of its first segment makes it differ from every other one.
+// The chunks of a buffer come from consecutive pool chunks, so they don't
+// repeat inside the buffer; the other chunks are random pool chunks.
+class DataPattern {
+	static constexpr size_t chunk_size   = 4096;
+	static constexpr size_t segment_size = 512;
+	static constexpr size_t pool_chunks  = 1024; // 4 MiB
+	static constexpr size_t max_stamp    = 16;
+
+	bool     active_ = false;
+	double   unique_ratio = 1.0;
+	size_t   random_len = segment_size; // per segment, multiple of 8
+	size_t   stamp_len  = max_stamp;    // multiple of 8
+	std::unique_ptr<aligned_buffer_t[]> pool;
+
+	inline const char* pool_chunk(size_t i) const {
+		return pool[0].data + (i % pool_chunks) * chunk_size;
+	}
+
+	void fill_chunk(char* chunk, Randomizer& r) const {
+		for (size_t i = 0; i < chunk_size; i += segment_size) {
+			r.randomize_buffer(chunk + i, random_len);
+			memset(chunk + i + random_len, 0, segment_size - random_len);
+		}
+	}
+
+	public: //---------------------------------------------------------------------
+	void configure(double compress_ratio, double dedup_ratio) {
+		DEBUG_MSG("compress_ratio={}, dedup_ratio={}", compress_ratio, dedup_ratio);
+		active_ = (compress_ratio > 1.0 || dedup_ratio > 1.0);
+		if (!active_) return;
+
+		random_len = std::max<size_t>(8, static_cast<size_t>(segment_size / compress_ratio) & ~size_t(7));
+		stamp_len  = std::min(max_stamp, random_len);
+		unique_ratio = 1.0 / dedup_ratio;
+
+		pool.reset(new aligned_buffer_t[pool_chunks * chunk_size / sizeof(aligned_buffer_t)]);
+		for (size_t i = 0; i < pool_chunks; i++)
+			fill_chunk(pool[0].data + i * chunk_size, randomizer);
+
+		spdlog::info("write data pattern: compress_ratio={}, dedup_ratio={}", compress_ratio, dedup_ratio);
+	}
+
+	inline bool active() const { return active_; }
+
+	void fill(char* buffer, size_t size, Randomizer& r) const {
+		assert(active_);
+		size_t next = r.uniform(pool_chunks); // of the unique chunks
+		size_t i = 0;
+		for (; i + chunk_size <= size; i += chunk_size) {
+			if (r.randomize_ratio(unique_ratio)) {
+				memcpy(buffer + i, pool_chunk(next++), chunk_size);
+				r.randomize_buffer(buffer + i + random_len - stamp_len, stamp_len);
+			} else {
+				memcpy(buffer + i, pool_chunk(r.uniform(pool_chunks)), chunk_size);
+			}
+		}
+		if (i < size)
+			memcpy(buffer + i, pool_chunk(r.uniform(pool_chunks)), size - i);
+	}
+};
+
+DataPattern data_pattern;
+
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "Stats::"
+
+/*_f(STAT_name)*/
+#define ALL_STATS_F( _f )   \
+	_f(blocks)              \
+	_f(blocks_read)         \
+	_f(blocks_write)        \
+	_f(KB_read)             \
+	_f(KB_write)            \
+	_f(blocks_discard)      \
+	_f(KB_discard)          \
+	_f(faults_major)        \
+	_f(faults_minor)        \
+	_f(verify_ok)           \
+	_f(verify_unknown)      \
+	_f(verify_errors)
+
+struct Stats {
+#	define declareStat(STAT_name) uint64_t STAT_name = 0;
+	ALL_STATS_F( declareStat )
+#	undef declareStat
+
+	Stats operator- (const Stats& val) const {
+		Stats ret = *this;
+#		define subStat(STAT_name) ret.STAT_name -= val.STAT_name;
+		ALL_STATS_F( subStat )
+#		undef subStat
+		return ret;
+	}
+	Stats& operator+= (const Stats& val) {
+#		define addStat(STAT_name) STAT_name += val.STAT_name;
+		ALL_STATS_F( addStat )
+#		undef addStat
+		return *this;
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "Histogram::"
+
+// Log-linear (HDR-style) histogram of latencies in nanoseconds. Values below
+// 2*sub_buckets are counted exactly and every following power of two is split
+// into sub_buckets linear buckets, which bounds the relative error to ~3%.
+struct Histogram {
+	static constexpr uint32_t sub_bucket_bits = 5;
+	static constexpr uint64_t sub_buckets     = 1 << sub_bucket_bits;
+	static constexpr uint32_t max_value_bits  = 40; // ~18 minutes
+	static constexpr uint64_t max_value       = (1ULL << max_value_bits) -1;
+	static constexpr uint32_t n_buckets       = (max_value_bits - sub_bucket_bits + 1) * sub_buckets;
+
+	uint64_t count = 0;
+	uint64_t sum   = 0;
+	uint64_t buckets[n_buckets] = {0};
+
+	static inline uint32_t bucket_index(uint64_t value) {
+		if (value > max_value)
+			value = max_value;
+		if (value < 2 * sub_buckets)
+			return value;
+		uint32_t shift = (63 - __builtin_clzll(value)) - sub_bucket_bits;
+		return shift * sub_buckets + (value >> shift);
+	}
+
+	static inline uint64_t bucket_upper_value(uint32_t index) {
+		if (index < 2 * sub_buckets)
+			return index;
+		uint32_t shift = index / sub_buckets - 1;
+		uint64_t sub   = index - shift * sub_buckets;
+		return ((sub + 1) << shift) - 1;
+	}
+
+	Histogram operator- (const Histogram& val) const {
+		Histogram ret = *this;
+		ret.count -= val.count;
+		ret.sum   -= val.sum;
+		for (uint32_t i = 0; i < n_buckets; i++)
+			ret.buckets[i] -= val.buckets[i];
+		return ret;
+	}
+	Histogram& operator+= (const Histogram& val) {
+		count += val.count;
+		sum   += val.sum;
+		for (uint32_t i = 0; i < n_buckets; i++)
+			buckets[i] += val.buckets[i];
+		return *this;
+	}
+
+	uint64_t percentile(double p) const {
+		if (count == 0) return 0;
+		uint64_t target = std::ceil(p / 100.0 * static_cast<double>(count));
+		if (target == 0) target = 1;
+		uint64_t acc = 0;
+		for (uint32_t i = 0; i < n_buckets; i++) {
+			acc += buckets[i];
+			if (acc >= target)
+				return bucket_upper_value(i);
+		}
+		return max_value;
+	}
+
+	uint64_t max() const {
+		for (uint32_t i = n_buckets; i > 0; i--) {
+			if (buckets[i-1] > 0)
+				return bucket_upper_value(i-1);
+		}
+		return 0;
+	}
+
+	double mean() const {
+		return (count > 0) ? static_cast<double>(sum) / static_cast<double>(count) : 0.0;
+	}
+
+	// STATS fields in microseconds: <prefix>_lat_{avg,p50,p90,p99,p99.9,max}_us
+	std::string str_stat(const char* prefix) const {
+		std::string ret;
+		ret += fmt::format(", \"{}_lat_avg_us\":\"{:.1f}\"", prefix, mean() / 1000.0);
+		for (auto p: {50.0, 90.0, 99.0, 99.9}) {
+			ret += fmt::format(", \"{}_lat_p{}_us\":\"{:.1f}\"", prefix, p, static_cast<double>(percentile(p)) / 1000.0);
+		}
+		ret += fmt::format(", \"{}_lat_max_us\":\"{:.1f}\"", prefix, static_cast<double>(max()) / 1000.0);
+		return ret;
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "AtomicHistogram::"
+
+// Single-writer version of Histogram. The owner thread updates it with relaxed
+// load/store pairs (no locked instructions) and any thread may read a copy.
+class AtomicHistogram {
+	std::atomic<uint64_t> sum {0};
+	std::atomic<uint64_t> buckets[Histogram::n_buckets];
+
+	static inline void inc(std::atomic<uint64_t>& v, uint64_t n) {
+		v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	public: //---------------------------------------------------------------------
+	AtomicHistogram() {
+		for (auto& i: buckets)
+			i.store(0, std::memory_order_relaxed);
+	}
+
+	inline void record(uint64_t value) {
+		inc(buckets[Histogram::bucket_index(value)], 1);
+		inc(sum, value);
+	}
+
+	void add_to(Histogram& h) const {
+		// count is derived from the buckets, so percentiles stay consistent
+		// with a copy taken while the owner thread is recording
+		h.sum += sum.load(std::memory_order_relaxed);
+		for (uint32_t i = 0; i < Histogram::n_buckets; i++) {
+			auto b = buckets[i].load(std::memory_order_relaxed);
+			h.buckets[i] += b;
+			h.count      += b;
+		}
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "StatsCollector::"
+
+typedef std::chrono::steady_clock latency_clock;
+
+inline uint64_t latency_ns(const latency_clock::time_point& begin, const latency_clock::time_point& end) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+}
+
+// sleep_until() alone may be late by the timer slack (~50us or more), so the
+// last part of the wait is spent spinning.
+inline void precise_sleep_until(const latency_clock::time_point& due_time) {
+	const auto spin_time = std::chrono::microseconds(100);
+	auto now = latency_clock::now();
+	if (due_time - now > spin_time)
+		std::this_thread::sleep_until(due_time - spin_time);
+	while (latency_clock::now() < due_time)
+		std::this_thread::yield();
+}
+
+// Time left until due_time, 0 if it has passed.
+inline uint64_t ns_until(const latency_clock::time_point& due_time) {
+	auto now = latency_clock::now();
+	return (due_time > now) ? latency_ns(now, due_time) : 0;
+}
+
+static constexpr uint32_t max_size_classes = 8;
+
+struct Latency {
+	Histogram read;
+	Histogram write;
+	Histogram fault; // accesses with major page faults (mmap engine)
+	Histogram flush; // --flush_blocks
+	Histogram discard; // --discard_ratio
+
+	// latency per request size (--block_size_mix)
+	uint64_t  size_class[max_size_classes] = {0}; // B, 0 = unused
+	Histogram size_latency[max_size_classes];
+
+	Latency operator- (const Latency& val) const {
+		Latency ret;
+		ret.read  = read  - val.read;
+		ret.write = write - val.write;
+		ret.fault = fault - val.fault;
+		ret.flush = flush - val.flush;
+		ret.discard = discard - val.discard;
+		for (uint32_t i = 0; i < max_size_classes; i++) {
+			ret.size_class[i]   = size_class[i];
+			ret.size_latency[i] = size_latency[i] - val.size_latency[i];
+		}
+		return ret;
+	}
+};
+
+// Counters and latency histograms sharded per engine thread. Each shard has a
+// single writer (its thread), so updates need no locks or locked instructions.
+// The counters of a shard are protected by a seqlock, so the report thread
+// always reads a consistent set of values. Shards of finished threads are
+// reused by new threads without being reset, which keeps the totals monotonic.
+class StatsCollector {
+	static constexpr uint32_t max_shards = 4 * max_iodepth;
+
+	struct alignas(64) Shard {
+		std::atomic<uint32_t> seq {0};
+#		define declareStat(STAT_name) std::atomic<uint64_t> STAT_name {0};
+		ALL_STATS_F( declareStat )
+#		undef declareStat
+
+		alignas(64) AtomicHistogram read_latency;
+		AtomicHistogram             write_latency;
+		AtomicHistogram             fault_latency;
+		AtomicHistogram             flush_latency;
+		AtomicHistogram             discard_latency;
+		std::atomic<AtomicHistogram*> size_latency[max_size_classes]; // allocated on the first use
+
+		std::atomic<bool> in_use {true};
+
+		Shard() {
+			for (auto& i: size_latency)
+				i.store(nullptr, std::memory_order_relaxed);
+		}
+		~Shard() {
+			for (auto& i: size_latency)
+				delete i.load(std::memory_order_relaxed);
+		}
+
+		inline void add(const Stats& val) {
+			auto s = seq.load(std::memory_order_relaxed);
+			seq.store(s + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+#			define addStat(STAT_name) STAT_name.store(STAT_name.load(std::memory_order_relaxed) + val.STAT_name, std::memory_order_relaxed);
+			ALL_STATS_F( addStat )
+#			undef addStat
+			seq.store(s + 2, std::memory_order_release);
+		}
+
+		void add_to(Stats& ret) const {
+			Stats aux;
+			uint32_t s1, s2;
+			do {
+				s1 = seq.load(std::memory_order_acquire);
+#				define loadStat(STAT_name) aux.STAT_name = STAT_name.load(std::memory_order_relaxed);
+				ALL_STATS_F( loadStat )
+#				undef loadStat
+				std::atomic_thread_fence(std::memory_order_acquire);
+				s2 = seq.load(std::memory_order_relaxed);
+			} while (s1 != s2 || (s1 & 1));
+			ret += aux;
+		}
+	};
+
+	// Returns the shard to the collector when its thread finishes.
+	struct LocalShard {
+		uint64_t collector_id = 0;
+		Shard*   shard        = nullptr;
+		~LocalShard() {
+			if (shard != nullptr)
+				shard->in_use.store(false, std::memory_order_release);
+		}
+	};
+
+	static std::atomic<uint64_t> instance_count;
+	const uint64_t instance_id;
+
+	std::mutex             shards_mutex; // only taken when a thread gets its shard
+	std::atomic<Shard*>    shards[max_shards];
+	std::atomic<uint32_t>  n_shards {0};
+
+	std::mutex             classes_mutex; // only taken when the size mixes change
+	std::atomic<uint64_t>  size_class[max_size_classes];
+	bool                   class_used[max_size_classes] = {false}; // its histograms have samples
+
+	// Returns the class of a request size, or -1 if it has none.
+	int get_size_class(uint64_t size) const {
+		for (int i = 0; i < max_size_classes; i++) {
+			if (size_class[i].load(std::memory_order_acquire) == size)
+				return i;
+		}
+		return -1;
+	}
+
+	Shard& local() {
+		thread_local LocalShard cached;
+		if (cached.collector_id != instance_id) {
+			cached.shard        = acquire_shard();
+			cached.collector_id = instance_id;
+		}
+		return *cached.shard;
+	}
+
+	Shard* acquire_shard() {
+		std::lock_guard<std::mutex> lock(shards_mutex);
+		auto n = n_shards.load(std::memory_order_relaxed);
+		for (uint32_t i = 0; i < n; i++) {
+			auto sh = shards[i].load(std::memory_order_relaxed);
+			bool expected = false;
+			if (sh->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+				DEBUG_MSG("reusing shard {}", i);
+				return sh;
+			}
+		}
+		if (n >= max_shards)
+			throw std::runtime_error(fmt::format("too many threads using statistics (max {})", max_shards).c_str());
+		DEBUG_MSG("new shard {}", n);
+		auto sh = new Shard();
+		shards[n].store(sh, std::memory_order_relaxed);
+		n_shards.store(n + 1, std::memory_order_release);
+		return sh;
+	}
+
+	public: //---------------------------------------------------------------------
+	StatsCollector() : instance_id(++instance_count) {
+		for (auto& i: shards)
+			i.store(nullptr, std::memory_order_relaxed);
+		for (auto& i: size_class)
+			i.store(0, std::memory_order_relaxed);
+	}
+
+	~StatsCollector() {
+		auto n = n_shards.load(std::memory_order_acquire);
+		for (uint32_t i = 0; i < n; i++)
+			delete shards[i].load(std::memory_order_relaxed);
+	}
+
+	inline void increment(const Stats& val) {
+		local().add(val);
+	}
+
+	inline void record_latency(bool write, uint64_t value_ns) {
+		auto& sh = local();
+		if (write)
+			sh.write_latency.record(value_ns);
+		else
+			sh.read_latency.record(value_ns);
+	}
+
+	inline void record_fault_latency(uint64_t value_ns) {
+		local().fault_latency.record(value_ns);
+	}
+
+	inline void record_flush_latency(uint64_t value_ns) {
+		local().flush_latency.record(value_ns);
+	}
+
+	inline void record_discard_latency(uint64_t value_ns) {
+		local().discard_latency.record(value_ns);
+	}
+
+	// Assigns the classes to the request sizes of the active mixes. The sizes
+	// that remain keep their class. The classes of the retired sizes are
+	// reused only when there are no unused ones, because their histograms
+	// still hold the samples of the old size.
+	void set_size_classes(const std::vector<uint64_t>& sizes) {
+		std::lock_guard<std::mutex> lock(classes_mutex);
+		std::vector<uint64_t> pending;
+		for (auto size: sizes) {
+			if (std::find(pending.begin(), pending.end(), size) == pending.end())
+				pending.push_back(size);
+		}
+		if (pending.size() > max_size_classes) {
+			spdlog::warn("latency per request size is only reported for {} sizes, dropping {} sizes of the mixes",
+				max_size_classes, pending.size() - max_size_classes);
+			pending.resize(max_size_classes);
+		}
+
+		bool keep[max_size_classes] = {false};
+		for (int i = 0; i < max_size_classes; i++) {
+			auto it = std::find(pending.begin(), pending.end(), size_class[i].load(std::memory_order_relaxed));
+			if (it != pending.end()) {
+				keep[i] = true;
+				pending.erase(it);
+			}
+		}
+		for (bool used: {false, true}) {
+			for (int i = 0; i < max_size_classes; i++) {
+				if (keep[i] || class_used[i] != used) continue;
+				uint64_t size = 0;
+				if (pending.size() > 0) {
+					size = pending.front();
+					pending.erase(pending.begin());
+					class_used[i] = true;
+					keep[i] = true;
+				}
+				size_class[i].store(size, std::memory_order_release);
+			}
+		}
+	}
+
+	inline void record_size_latency(uint64_t size, uint64_t value_ns) {
+		auto c = get_size_class(size);
+		if (c < 0) return;
+		auto& sh = local();
+		auto h = sh.size_latency[c].load(std::memory_order_relaxed);
+		if (h == nullptr) {
+			h = new AtomicHistogram();
+			sh.size_latency[c].store(h, std::memory_order_release);
+		}
+		h->record(value_ns);
+	}
+
+	void snapshot(Stats& ret) const {
+		ret = Stats();
+		auto n = n_shards.load(std::memory_order_acquire);
+		for (uint32_t i = 0; i < n; i++)
+			shards[i].load(std::memory_order_relaxed)->add_to(ret);
+	}
+
+	void snapshot(Latency& ret) const {
+		ret = Latency();
+		auto n = n_shards.load(std::memory_order_acquire);
+		for (uint32_t i = 0; i < n; i++) {
+			auto sh = shards[i].load(std::memory_order_relaxed);
+			sh->read_latency.add_to(ret.read);
+			sh->write_latency.add_to(ret.write);
+			sh->fault_latency.add_to(ret.fault);
+			sh->flush_latency.add_to(ret.flush);
+			sh->discard_latency.add_to(ret.discard);
+			for (uint32_t c = 0; c < max_size_classes; c++) {
+				auto h = sh->size_latency[c].load(std::memory_order_acquire);
+				if (h != nullptr)
+					h->add_to(ret.size_latency[c]);
+			}
+		}
+		for (uint32_t c = 0; c < max_size_classes; c++)
+			ret.size_class[c] = size_class[c].load(std::memory_order_acquire);
+	}
+};
+std::atomic<uint64_t> StatsCollector::instance_count {0};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "GenericEngine::"
+
+typedef std::function<void(const Stats& val)> increment_stats_t;
+typedef std::function<void()> engine_failed_t; // called by the threads of multithreaded engines when they fail
+// Request completed by an engine, reported through register_latency_t.
+struct IOCompletion {
+	bool      write;
+	int       file;   // index in the list of files (--filename)
+	long long offset; // in the file
+	size_t    size;
+	latency_clock::time_point submit_time;
+	uint64_t  latency_ns;
+	bool      discard = false; // write is false
+};
+
+typedef std::function<void(const IOCompletion& io)> register_latency_t;
+typedef std::function<void(uint64_t latency_ns)> register_fault_latency_t;
+
+class GenericEngine {
+	public: //---------------------------------------------------------------------
+	GenericEngine() {}
+	virtual ~GenericEngine() {}
+	virtual void make_requests(bool& stop_) {}
+	virtual void wait() {}
+	virtual bool is_multithread() {return false;}
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "AccessParams::"
+
+// A request with size 0 means that there is none (end of the trace).
+struct AccessParams {
+	typeof(Args::block_size) block_size = 0;
+	size_t     size   = 0;
+	int        file   = 0; // index in the list of files (--filename)
+	long long  offset = 0; // in the file
+	bool       write  = false;
+	bool       dsync  = false;
+	uint64_t   verify_tag = 0; // see Verifier::tag()
+	latency_clock::time_point intended_time {}; // open-loop modes: when the request must be sent (the engines wait for it)
+
+	// Latencies are measured from the intended time, when there is one, so
+	// that the time a request waited behind the previous ones is included.
+	inline latency_clock::time_point start_time() const {
+		return (intended_time != latency_clock::time_point()) ? intended_time : latency_clock::now();
+	}
+};
+
+// worker: the engine thread or request slot asking for the request (0 with a
+// single one), see --seq_stream_select=thread
+typedef std::function<AccessParams(uint32_t worker)> access_params_t;
+typedef std::function<void(long long offset)> offset_released_t;
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "FileQueues::"
+
+// In-flight queues of the asynchronous engines, one per file, each limited
+// to iodepth requests. A request for a file whose queue is full waits in that
+// file's list (up to iodepth requests) while requests for the other files go
+// on, so a slow device does not take the slots of the others.
+class FileQueues {
+	const uint32_t nfiles;
+	uint32_t&      depth;
+	access_params_t access_params;
+
+	std::vector<uint32_t>                 inflight;
+	std::vector<std::deque<AccessParams>> waiting;
+	std::deque<AccessParams>              overflow; // at most one request
+	uint32_t                              next_waiting = 0;
+
+	public: //---------------------------------------------------------------------
+	FileQueues(uint32_t nfiles_, uint32_t& depth_, access_params_t access_params_)
+		: nfiles(nfiles_), depth(depth_), access_params(access_params_),
+		  inflight(nfiles_, 0), waiting(nfiles_) {}
+
+	// number of request slots used by the engine
+	uint32_t slots() const {
+		return std::min<uint32_t>(max_iodepth, depth * nfiles);
+	}
+
+	// Returns false if no request can be issued now.
+	bool next(AccessParams& ret, uint32_t worker) {
+		if (nfiles == 1) {
+			ret = access_params(worker);
+			return ret.size > 0;
+		}
+
+		for (uint32_t i = 0; i < nfiles; i++) {
+			uint32_t f = (next_waiting + i) % nfiles;
+			if (waiting[f].size() > 0 && inflight[f] < depth) {
+				ret = waiting[f].front();
+				waiting[f].pop_front();
+				inflight[f]++;
+				next_waiting = (f + 1) % nfiles;
+				return true;
+			}
+		}
+
+		if (overflow.size() > 0) {
+			auto f = overflow.front().file;
+			if (waiting[f].size() >= depth)
+				return false;
+			waiting[f].push_back(overflow.front());
+			overflow.pop_front();
+		}
+
+		for (uint32_t attempt = 0; attempt < 2 * nfiles; attempt++) {
+			auto params = access_params(worker);
+			if (params.size == 0)
+				return false;
+			auto f = params.file;
+			if (inflight[f] < depth) {
+				ret = params;
+				inflight[f]++;
+				return true;
+			} else if (waiting[f].size() < depth) {
+				waiting[f].push_back(params);
+			} else {
+				overflow.push_back(params);
+				return false;
+			}
+		}
+		return false;
+	}
+
+	void released(int file) {
+		if (nfiles == 1) return;
+		assert(inflight[file] > 0);
+		inflight[file]--;
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "CRC32C::"
+
+// CRC32C (Castagnoli), using the SSE4.2 (x86_64) or ARMv8 CRC instructions
+// when available. crc3() computes three independent buffers in the same loop
+// to hide the latency of the crc instruction.
+class CRC32C {
+	static const uint32_t* table() {
+		static const struct Table {
+			uint32_t v[256];
+			Table() {
+				for (uint32_t i = 0; i < 256; i++) {
+					uint32_t c = i;
+					for (int k = 0; k < 8; k++)
+						c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+					v[i] = c;
+				}
+			}
+		} t;
+		return t.v;
+	}
+
+	static uint32_t sw(uint32_t crc, const char* p, size_t n) {
+		auto t = table();
+		for (size_t i = 0; i < n; i++)
+			crc = t[(crc ^ static_cast<uint8_t>(p[i])) & 0xff] ^ (crc >> 8);
+		return crc;
+	}
+
+#	if defined(__x86_64__)
+	__attribute__((target("sse4.2")))
+	static void hw3(const char* a, const char* b, const char* c, size_t n, uint32_t* out) {
+		uint64_t ca = ~0U, cb = ~0U, cc = ~0U;
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			uint64_t va, vb, vc;
+			memcpy(&va, a + i, 8); memcpy(&vb, b + i, 8); memcpy(&vc, c + i, 8);
+			ca = _mm_crc32_u64(ca, va);
+			cb = _mm_crc32_u64(cb, vb);
+			cc = _mm_crc32_u64(cc, vc);
+		}
+		for (; i < n; i++) {
+			ca = _mm_crc32_u8(ca, a[i]);
+			cb = _mm_crc32_u8(cb, b[i]);
+			cc = _mm_crc32_u8(cc, c[i]);
+		}
+		out[0] = ~ca; out[1] = ~cb; out[2] = ~cc;
+	}
+	static bool has_hw() {
+		static const bool ret = __builtin_cpu_supports("sse4.2");
+		return ret;
+	}
+#	elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+	static void hw3(const char* a, const char* b, const char* c, size_t n, uint32_t* out) {
+		uint32_t ca = ~0U, cb = ~0U, cc = ~0U;
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			uint64_t va, vb, vc;
+			memcpy(&va, a + i, 8); memcpy(&vb, b + i, 8); memcpy(&vc, c + i, 8);
+			ca = __crc32cd(ca, va);
+			cb = __crc32cd(cb, vb);
+			cc = __crc32cd(cc, vc);
+		}
+		for (; i < n; i++) {
+			ca = __crc32cb(ca, a[i]);
+			cb = __crc32cb(cb, b[i]);
+			cc = __crc32cb(cc, c[i]);
+		}
+		out[0] = ~ca; out[1] = ~cb; out[2] = ~cc;
+	}
+	static bool has_hw() { return true; }
+#	else
+	static void hw3(const char* a, const char* b, const char* c, size_t n, uint32_t* out) {}
+	static bool has_hw() { return false; }
+#	endif
+
+	public: //---------------------------------------------------------------------
+	static uint32_t crc(const char* p, size_t n) {
+		if (has_hw()) {
+			uint32_t out[3];
+			hw3(p, p, p, n, out);
+			return out[0];
+		}
+		return ~sw(~0U, p, n);
+	}
+
+	static void crc3(const char* a, const char* b, const char* c, size_t n, uint32_t* out) {
+		if (has_hw()) {
+			hw3(a, b, c, n, out);
+			return;
+		}
+		out[0] = ~sw(~0U, a, n);
+		out[1] = ~sw(~0U, b, n);
+		out[2] = ~sw(~0U, c, n);
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "Verifier::"
+
+// Data-integrity verification (--verify). Every 4 KiB sector written carries a
+// header with its address, write generation and the seed of the run, followed
+// by a CRC32C of the rest of the sector. Reads validate the sectors: wrong
+// magic/seed in a sector written by this run, bad CRC (torn or corrupted),
+// wrong address (misdirected) and data older than a write completed before the
+// read was issued (stale) count as verify_errors.
+//
+// The expected generation of each sector, the completion sequence of its
+// last write and the number of writes and discards in flight are kept in
+// memory (24 bytes per sector). Writes to the same sector that complete out
+// of order leave it ambiguous until the next write, and stale data isn't
+// checked meanwhile. A read that overlapped a write or a discard to the same
+// sector (in flight when the read is checked, or completed after the read
+// was issued) may legitimately see torn, old or missing data, so these
+// sectors count as verify_unknown instead of errors.
+class Verifier {
+	public: //---------------------------------------------------------------------
+	static constexpr uint64_t sector_size = 4096;
+
+	private: //--------------------------------------------------------------------
+	static constexpr uint32_t magic       = 0x33544156; // "VAT3"
+	static constexpr uint32_t max_logged  = 10;
+	static constexpr uint64_t chunk       = 64; // sectors processed at a time
+
+	// state of a sector
+	struct Sector {
+		std::atomic<uint64_t> generation {0}; // of the last write << 1 | ambiguous, 0 = unknown
+		std::atomic<uint64_t> completed  {0}; // sequence of the last completed write
+		std::atomic<uint16_t> inflight   {0}; // writes and discards
+	};
+	static_assert(sizeof(Sector) == 24, "update the memory use in the class comment");
+
+	struct Header {
+		uint32_t magic;
+		uint32_t crc;        // of the sector after this field
+		uint64_t sector;     // file << 48 | sector number in the file
+		uint64_t generation;
+		uint64_t seed;
+	};
+	static constexpr size_t crc_offset = offsetof(Header, sector);
+
+	const uint64_t seed;
+	std::atomic<uint64_t> generation {0};
+	std::atomic<uint64_t> completed  {0}; // sequence of the completed writes
+	std::atomic<uint32_t> logged     {0};
+
+	std::vector<std::unique_ptr<Sector[]>> sectors; // per file
+	std::vector<uint64_t> n_sectors;
+
+	static inline uint64_t sector_id(int file, uint64_t sector) {
+		return (static_cast<uint64_t>(file) << 48) | sector;
+	}
+
+	template<typename... Args>
+	void log_error(const char* format, const Args&... args) {
+		if (logged.fetch_add(1, std::memory_order_relaxed) < max_logged)
+			spdlog::error("verify: {}", fmt::format(format, args...));
+	}
+
+	// crc of the n sectors of buffer, three at a time
+	static void crc_sectors(const char* buffer, uint64_t n, uint32_t* out) {
+		const size_t len = sector_size - crc_offset;
+		uint64_t i = 0;
+		for (; i + 3 <= n; i += 3) {
+			CRC32C::crc3(buffer + i * sector_size + crc_offset,
+			             buffer + (i + 1) * sector_size + crc_offset,
+			             buffer + (i + 2) * sector_size + crc_offset, len, out + i);
+		}
+		for (; i < n; i++)
+			out[i] = CRC32C::crc(buffer + i * sector_size + crc_offset, len);
+	}
+
+	static inline bool aligned(long long offset, size_t size) {
+		return offset % sector_size == 0 && size % sector_size == 0 && size > 0;
+	}
+
+	// whole sectors of a range inside the file: [first, last)
+	inline void range(int file, long long offset, size_t size, uint64_t& first, uint64_t& last) const {
+		first = (offset + sector_size - 1) / sector_size;
+		last  = std::max(first, std::min<uint64_t>((offset + size) / sector_size, n_sectors[file]));
+	}
+
+	void begin_update(int file, long long offset, size_t size) {
+		uint64_t first, last;
+		range(file, offset, size, first, last);
+		for (uint64_t i = first; i < last; i++)
+			sectors[file][i].inflight.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	public: //---------------------------------------------------------------------
+	Verifier(const std::vector<uint64_t>& file_sizes, uint64_t seed_) : seed(seed_) {
+		DEBUG_MSG("constructor");
+		for (auto size: file_sizes) {
+			uint64_t n = size / sector_size;
+			sectors.emplace_back(new Sector[n]);
+			n_sectors.push_back(n);
+		}
+		spdlog::info("verify mode enabled (seed {:#x}, {} MiB of sector state)", seed,
+			std::accumulate(n_sectors.begin(), n_sectors.end(), uint64_t(0)) * sizeof(Sector) / 1024 / 1024);
+	}
+
+	// Tag of a new request: the generation of a write, or the completion
+	// sequence at the time a read is issued. The sectors of a write are in
+	// flight until written() is called, whether or not it was sent.
+	uint64_t tag(const AccessParams& params) {
+		if (params.write) {
+			if (aligned(params.offset, params.size))
+				begin_update(params.file, params.offset, params.size);
+			return generation.fetch_add(1, std::memory_order_relaxed) + 1;
+		}
+		return completed.load(std::memory_order_acquire);
+	}
+
+	// Writes the headers and CRCs of the sectors of a write request.
+	void stamp(char* buffer, int file, long long offset, size_t size, uint64_t tag) {
+		if (!aligned(offset, size)) return;
+		const uint64_t n = size / sector_size;
+		const uint64_t first = offset / sector_size;
+		for (uint64_t i = 0; i < n; i++) {
+			auto h = reinterpret_cast<Header*>(buffer + i * sector_size);
+			h->magic      = magic;
+			h->sector     = sector_id(file, first + i);
+			h->generation = tag;
+			h->seed       = seed;
+		}
+		uint32_t crcs[chunk];
+		for (uint64_t c = 0; c < n; c += chunk) {
+			const uint64_t m = std::min(chunk, n - c);
+			crc_sectors(buffer + c * sector_size, m, crcs);
+			for (uint64_t i = 0; i < m; i++)
+				reinterpret_cast<Header*>(buffer + (c + i) * sector_size)->crc = crcs[i];
+		}
+	}
+
+	// Registers a finished write request. The sectors of a write that was not
+	// completed (not sent, failed or short) are forgotten: they may hold the
+	// old or the new data.
+	void written(int file, long long offset, size_t size, uint64_t tag, bool done) {
+		if (!aligned(offset, size)) return;
+		const uint64_t seq = completed.fetch_add(1, std::memory_order_acq_rel) + 1;
+		uint64_t first, last;
+		range(file, offset, size, first, last);
+		for (uint64_t i = first; i < last; i++) {
+			auto& e = sectors[file][i];
+			if (done) {
+				auto old = e.generation.load(std::memory_order_relaxed);
+				uint64_t value;
+				do {
+					if (old == 0 || tag > (old >> 1))
+						value = tag << 1;
+					else
+						value = old | 1; // an older write completed after a newer one
+				} while (!e.generation.compare_exchange_weak(old, value, std::memory_order_relaxed));
+			} else {
+				e.generation.store(0, std::memory_order_relaxed);
+			}
+			auto old_seq = e.completed.load(std::memory_order_relaxed);
+			while (old_seq < seq && !e.completed.compare_exchange_weak(old_seq, seq, std::memory_order_relaxed)) {}
+			e.inflight.fetch_sub(1, std::memory_order_release);
+		}
+	}
+
+	// Registers a discard request about to be sent.
+	void discarding(int file, long long offset, size_t size) {
+		begin_update(file, offset, size);
+	}
+
+	// Forgets the sectors of a discarded range, which are then read as unknown.
+	void discarded(int file, long long offset, size_t size) {
+		const uint64_t seq = completed.fetch_add(1, std::memory_order_acq_rel) + 1;
+		uint64_t first, last;
+		range(file, offset, size, first, last);
+		for (uint64_t i = first; i < last; i++) {
+			auto& e = sectors[file][i];
+			e.generation.store(0, std::memory_order_relaxed);
+			auto old_seq = e.completed.load(std::memory_order_relaxed);
+			while (old_seq < seq && !e.completed.compare_exchange_weak(old_seq, seq, std::memory_order_relaxed)) {}
+			e.inflight.fetch_sub(1, std::memory_order_release);
+		}
+	}
+
+	// Validates the sectors of a completed read request.
+	void check(const char* buffer, int file, long long offset, size_t size, uint64_t tag, Stats& stats) {
+		if (!aligned(offset, size)) return;
+		const uint64_t n = size / sector_size;
+		const uint64_t first = offset / sector_size;
+		const uint64_t read_seq = tag;
+
+		uint32_t crcs[chunk];
+		for (uint64_t i = 0; i < n; i++) {
+			if (i % chunk == 0)
+				crc_sectors(buffer + i * sector_size, std::min(chunk, n - i), crcs);
+			const uint32_t crc = crcs[i % chunk];
+			auto h = reinterpret_cast<const Header*>(buffer + i * sector_size);
+			uint64_t e = 0;
+			bool overlapped = false; // with a write or discard to the sector
+			if (first + i < n_sectors[file]) {
+				auto& sector = sectors[file][first + i];
+				overlapped = sector.inflight.load(std::memory_order_acquire) > 0;
+				e = sector.generation.load(std::memory_order_relaxed);
+				overlapped = overlapped || sector.completed.load(std::memory_order_relaxed) > read_seq;
+			}
+
+			if (h->magic != magic || h->seed != seed) {
+				if (e == 0 || overlapped) {
+					stats.verify_unknown++; // not written by this run, or being written
+				} else {
+					stats.verify_errors++;
+					log_error("file {} offset {}: sector without a valid header (torn or lost write)", file, (first + i) * sector_size);
+				}
+				continue;
+			}
+			if (h->crc != crc) {
+				if (overlapped) {
+					stats.verify_unknown++; // torn by a concurrent write
+					continue;
+				}
+				stats.verify_errors++;
+				log_error("file {} offset {}: CRC mismatch (generation {})", file, (first + i) * sector_size, h->generation);
+				continue;
+			}
+			if (h->sector != sector_id(file, first + i)) {
+				stats.verify_errors++;
+				log_error("file {} offset {}: misdirected data from file {} offset {}", file, (first + i) * sector_size,
+					h->sector >> 48, (h->sector & ((1ULL << 48) - 1)) * sector_size);
+				continue;
+			}
+			const uint64_t e_gen = e >> 1;
+			if (e != 0 && !(e & 1) && !overlapped && h->generation < e_gen) {
+				stats.verify_errors++;
+				log_error("file {} offset {}: stale data (generation {}, expected {})", file, (first + i) * sector_size,
+					h->generation, e_gen);
+				continue;
+			}
+			stats.verify_ok++;
+		}
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "PosixEngine::"
+
+class PosixEngine : public GenericEngine {
+	const std::vector<int>& fds;
+
+	increment_stats_t increment_stats;
+	register_latency_t register_latency;
+	access_params_t access_params;
+	offset_released_t offset_released;
+	Verifier* verifier;
+
+	IOBuffer   buffer_mem;
+	char*      buffer = nullptr;
+	size_t     cur_size = 0;
+	int        cur_file = 0;
+	long long  cur_offset = 0;
+	bool       cur_write = false;
+
+	public:  // ------------------------------------------------------------
+	PosixEngine(const std::vector<int>& fds_, increment_stats_t increment_stats_, register_latency_t register_latency_,
+	          access_params_t access_params_, offset_released_t offset_released_, Verifier* verifier_)
+	          : fds(fds_), increment_stats(increment_stats_), register_latency(register_latency_),
+	            access_params(access_params_), offset_released(offset_released_), verifier(verifier_)
+	{
+		DEBUG_MSG("constructor");
+	}
+
+	~PosixEngine() {
+		DEBUG_MSG("destructor");
+	}
+
+	void make_requests(bool& stop_) {
+		if (stop_) return;
+
+		auto params = access_params(0);
+		if (params.size == 0)
+			return;
+		if (cur_size != params.size) {
+			DEBUG_MSG("request size changed from {} to {}", cur_size, params.size);
+			cur_size = params.size;
+			if (cur_size > buffer_mem.capacity()) { // smaller requests reuse the buffer
+				buffer_mem.reset(cur_size);
+				buffer = buffer_mem.data();
+				randomizer.randomize_buffer(buffer, buffer_mem.capacity());
+			}
+		} else if (params.write && cur_write && !data_pattern.active()) { // randomize 5% of the buffer due to repeated writes
+			randomizer.randomize_buffer(buffer, cur_size, 20);
+		}
+		if (params.write && data_pattern.active())
+			data_pattern.fill(buffer, cur_size, randomizer);
+
+		auto stats = Stats{
+			.blocks = 1,
+			.blocks_read  = static_cast<uint64_t>( (!params.write) ? 1 : 0 ),
+			.blocks_write = static_cast<uint64_t>( ( params.write) ? 1 : 0 ),
+			.KB_read  = (!params.write) ? params.block_size : 0,
+			.KB_write = ( params.write) ? params.block_size : 0,
+		};
+
+		int fd = fds[params.file];
+		if (cur_file != params.file || cur_offset + cur_size != params.offset) {
+			if (lseek(fd, params.offset, SEEK_SET) == -1)
+				throw std::runtime_error(fmt::format("seek error: {}", strerror(errno)).c_str());
+		}
+		cur_file = params.file;
+		cur_offset = params.offset;
+		cur_write = params.write;
+
+		if (params.intended_time != latency_clock::time_point())
+			precise_sleep_until(params.intended_time);
+		if (stop_) {
+			if (verifier && params.write)
+				verifier->written(params.file, params.offset, cur_size, params.verify_tag, false);
+			return;
+		}
+
+		if (verifier && params.write)
+			verifier->stamp(buffer, params.file, params.offset, cur_size, params.verify_tag);
+
+		auto submit_time = params.start_time();
+		if (params.write) {
+			iovec iov {buffer, cur_size};
+			if ((params.dsync ? pwritev2(fd, &iov, 1, -1, RWF_DSYNC) : write(fd, buffer, cur_size)) == -1)
+				throw std::runtime_error(fmt::format("write error: {}", strerror(errno)).c_str());
+		} else {
+			if (read(fd, buffer, cur_size) == -1)
+				throw std::runtime_error(fmt::format("read error: {}", strerror(errno)).c_str());
+		}
+		register_latency({params.write, params.file, params.offset, cur_size, submit_time, latency_ns(submit_time, latency_clock::now())});
+
+		if (verifier) {
+			if (params.write)
+				verifier->written(params.file, params.offset, cur_size, params.verify_tag, true);
+			else
+				verifier->check(buffer, params.file, params.offset, cur_size, params.verify_tag, stats);
+		}
+
+		offset_released(cur_offset);
+		increment_stats(stats);
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "MmapEngine::"
+
+// Accesses the files through shared memory mappings, so the I/O is generated
+// by page faults (reads) and dirty page write-back (writes). The faults of
+// each access are counted with getrusage(RUSAGE_THREAD).
+class MmapEngine : public GenericEngine {
+	struct Mapping {
+		char*    addr = nullptr;
+		uint64_t size = 0;
+	};
+	std::vector<Mapping> maps;
+
+	increment_stats_t        increment_stats;
+	register_latency_t       register_latency;
+	register_fault_latency_t register_fault_latency;
+	access_params_t          access_params;
+	offset_released_t        offset_released;
+	Verifier*                verifier;
+
+	IOBuffer   buffer_mem;
+	char*      buffer = nullptr;
+	size_t     cur_size = 0;
+	bool       cur_write = false;
+
+	static constexpr uint64_t page_size = 4096;
+
+	public:  // ------------------------------------------------------------
+	MmapEngine(const std::vector<int>& fds, const std::vector<uint64_t>& file_sizes, const string& advice,
+	           increment_stats_t increment_stats_, register_latency_t register_latency_,
+	           register_fault_latency_t register_fault_latency_,
+	           access_params_t access_params_, offset_released_t offset_released_, Verifier* verifier_)
+	          : increment_stats(increment_stats_), register_latency(register_latency_),
+	            register_fault_latency(register_fault_latency_),
+	            access_params(access_params_), offset_released(offset_released_), verifier(verifier_)
+	{
+		DEBUG_MSG("constructor");
+		assert(fds.size() == file_sizes.size());
+
+		int advice_flag = MADV_NORMAL;
+		if (advice == "random")
+			advice_flag = MADV_RANDOM;
+		else if (advice == "sequential")
+			advice_flag = MADV_SEQUENTIAL;
+		else if (advice == "willneed")
+			advice_flag = MADV_WILLNEED;
+
+		for (int i = 0; i < fds.size(); i++) {
+			Mapping m;
+			m.size = file_sizes[i];
+			void* addr = mmap(nullptr, m.size, PROT_READ|PROT_WRITE, MAP_SHARED, fds[i], 0);
+			if (addr == MAP_FAILED)
+				throw std::runtime_error(fmt::format("mmap error: {}", strerror(errno)).c_str());
+			m.addr = static_cast<char*>(addr);
+			maps.push_back(m);
+
+			if (advice_flag != MADV_NORMAL && madvise(m.addr, m.size, advice_flag) != 0)
+				spdlog::warn("madvise({}) returned error: {}", advice, strerror(errno));
+		}
+	}
+
+	~MmapEngine() {
+		DEBUG_MSG("destructor");
+		for (auto& m: maps)
+			munmap(m.addr, m.size);
+	}
+
+	void make_requests(bool& stop_) {
+		if (stop_) return;
+
+		auto params = access_params(0);
+		if (params.size == 0)
+			return;
+		if (cur_size != params.size) {
+			DEBUG_MSG("request size changed from {} to {}", cur_size, params.size);
+			cur_size = params.size;
+			if (cur_size > buffer_mem.capacity()) { // smaller requests reuse the buffer
+				buffer_mem.reset(cur_size);
+				buffer = buffer_mem.data();
+				randomizer.randomize_buffer(buffer, buffer_mem.capacity());
+			}
+		} else if (params.write && cur_write && !data_pattern.active()) { // randomize 5% of the buffer due to repeated writes
+			randomizer.randomize_buffer(buffer, cur_size, 20);
+		}
+		if (params.write && data_pattern.active())
+			data_pattern.fill(buffer, cur_size, randomizer);
+		cur_write = params.write;
+
+		auto& m = maps[params.file];
+		assert(params.offset + cur_size <= m.size);
+		char* addr = m.addr + params.offset;
+
+		if (params.intended_time != latency_clock::time_point())
+			precise_sleep_until(params.intended_time);
+		if (stop_) {
+			if (verifier && params.write)
+				verifier->written(params.file, params.offset, cur_size, params.verify_tag, false);
+			return;
+		}
+
+		if (verifier && params.write)
+			verifier->stamp(buffer, params.file, params.offset, cur_size, params.verify_tag);
+
+		rusage ru_before, ru_after;
+		getrusage(RUSAGE_THREAD, &ru_before);
+
+		auto submit_time = params.start_time();
+		if (params.write) {
+			memcpy(addr, buffer, cur_size);
+			if (params.dsync) {
+				char* page = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(addr) & ~(page_size - 1));
+				if (msync(page, (addr + cur_size) - page, MS_SYNC) != 0)
+					throw std::runtime_error(fmt::format("msync error: {}", strerror(errno)).c_str());
+			}
+		} else {
+			memcpy(buffer, addr, cur_size);
+		}
+		auto lat = latency_ns(submit_time, latency_clock::now());
+
+		getrusage(RUSAGE_THREAD, &ru_after);
+
+		auto stats = Stats{
+			.blocks = 1,
+			.blocks_read  = static_cast<uint64_t>( (!params.write) ? 1 : 0 ),
+			.blocks_write = static_cast<uint64_t>( ( params.write) ? 1 : 0 ),
+			.KB_read  = (!params.write) ? params.block_size : 0,
+			.KB_write = ( params.write) ? params.block_size : 0,
+			.faults_major = static_cast<uint64_t>(ru_after.ru_majflt - ru_before.ru_majflt),
+			.faults_minor = static_cast<uint64_t>(ru_after.ru_minflt - ru_before.ru_minflt),
+		};
+
+		register_latency({params.write, params.file, params.offset, cur_size, submit_time, lat});
+		if (stats.faults_major > 0)
+			register_fault_latency(lat);
+
+		if (verifier) {
+			if (params.write)
+				verifier->written(params.file, params.offset, cur_size, params.verify_tag, true);
+			else
+				verifier->check(buffer, params.file, params.offset, cur_size, params.verify_tag, stats);
+		}
+
+		offset_released(params.offset);
+		increment_stats(stats);
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "AIORequest::"
+
+class AIORequest {
+	public:  // ------------------------------------------------------------
+	struct Options {
+		int                 pos_count = 0;
+		uint32_t            worker_first = 0; // worker of a request: worker_first + pos * worker_step
+		uint32_t            worker_step  = 1;
+		const std::vector<int>& fds;
+		io_context_t*       ctx;
+		int                 eventfd;
+		FileQueues*         queues;
+		offset_released_t   offset_released;
+		Verifier*           verifier;
+
+		Options(const std::vector<int>& fds_, io_context_t* ctx_, int eventfd_, FileQueues* queues_,
+		        offset_released_t offset_released_, Verifier* verifier_)
+		        : fds(fds_), ctx(ctx_), eventfd(eventfd_),
+				  queues(queues_),
+				  offset_released(offset_released_), verifier(verifier_) {}
+	};
+
+	Options*         options;
+	int              pos    = -1;
+	bool             active = false;
+	bool             write  = false;
+	iocb             cb;
+	Stats            stats;
+	size_t           size   = 0;
+	int              file   = 0;
+	long long        offset = 0;
+	uint64_t         verify_tag = 0;
+	bool             prepared = false; // not submitted yet
+	latency_clock::time_point intended_time;
+	latency_clock::time_point submit_time;
+
+	IOBuffer         buffer_mem;
+	char*            buffer = nullptr;
+
+	AIORequest(Options* options_) : options(options_) {
+		assert( options != nullptr );
+		pos = options->pos_count++;
+	}
+
+	~AIORequest() {
+		if (active) {
+			spdlog::info("AIORequest[{}] is still active. Canceling it.", pos);
+			io_event event;
+			auto ret = io_cancel(*(options->ctx), &cb, &event);
+			if (ret < 0) {
+				spdlog::warn("\tio_cancel returned error {}:{}", ret, E2S(ret));
+			}
+		}
+	}
+
+	// Prepares the iocb of the next request. It is submitted by AIOContext
+	// in a batch, which calls either submitted() or not_submitted().
+	bool prepare() {
+		assert(pos >= 0);
+		assert(!active);
+
+		AccessParams params;
+		if (! options->queues->next(params, options->worker_first + pos * options->worker_step))
+			return false;
+		assert(params.size > 0);
+		if (size != params.size) {
+			DEBUG_MSG("request size changed from {} to {}", size, params.size);
+			size = params.size;
+			if (size > buffer_mem.capacity()) { // smaller requests reuse the buffer
+				buffer_mem.reset(size);
+				buffer = buffer_mem.data();
+				randomizer.randomize_buffer(buffer, buffer_mem.capacity());
+			}
+		} else if (params.write && write && !data_pattern.active()) { // randomize 5% of the buffer due to repeated writes
+			randomizer.randomize_buffer(buffer, size, 20);
+		}
+		if (params.write && data_pattern.active())
+			data_pattern.fill(buffer, size, randomizer);
+
+		stats = Stats{
+			.blocks = 1,
+			.blocks_read  = static_cast<uint64_t>( (!params.write) ? 1 : 0 ),
+			.blocks_write = static_cast<uint64_t>( ( params.write) ? 1 : 0 ),
+			.KB_read  = (!params.write) ? params.block_size : 0,
+			.KB_write = ( params.write) ? params.block_size : 0,
+		};
+
+		write = params.write;
+		file = params.file;
+		offset = params.offset;
+		verify_tag = params.verify_tag;
+
+		if (params.write) {
+			if (options->verifier)
+				options->verifier->stamp(buffer, file, offset, size, verify_tag);
+			io_prep_pwrite(&cb, options->fds[file], buffer, size, offset);
+			if (params.dsync) {
+				cb.aio_rw_flags |= RWF_DSYNC;
+			}
+		} else { //read
+			io_prep_pread(&cb, options->fds[file], buffer, size, offset);
+		}
+		io_set_eventfd(&cb, options->eventfd); // IOCB_FLAG_RESFD
+		cb.data = this;
+
+		intended_time = params.intended_time;
+		prepared = true;
+		return true;
+	}
+
+	inline bool due() const {
+		return ns_until(intended_time) == 0;
+	}
+
+	void submitted() {
+		assert(!active);
+		active = true;
+		prepared = false;
+	}
+
+	void not_submitted() {
+		assert(!active);
+		prepared = false;
+		options->queues->released(file);
+		options->offset_released(offset);
+		if (options->verifier && write)
+			options->verifier->written(file, offset, size, verify_tag, false);
+	}
+
+	void request_finished(long res) {
+		assert(active);
+		active = false;
+		options->queues->released(file);
+		options->offset_released(offset);
+
+		if (options->verifier) {
+			if (write)
+				options->verifier->written(file, offset, size, verify_tag, res == size);
+			else if (res == size)
+				options->verifier->check(buffer, file, offset, size, verify_tag, stats);
+		}
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "AIOContext::"
+
+// An aio context with its requests, used by one thread of AIOEngine.
+// Every cycle submits all the prepared iocbs with a single io_submit. The
+// completions are signaled through an eventfd (IOCB_FLAG_RESFD) and, with
+// --aio_user_reap, read directly from the aio ring mapped in user space,
+// avoiding io_getevents.
+class AIOContext {
+	io_context_t ctx;
+	int          eventfd = -1;
+	bool         user_reap;
+
+	FileQueues queues;
+	std::unique_ptr<AIORequest::Options> request_options;
+	std::unique_ptr<std::unique_ptr<AIORequest>[]> request_list;
+
+	iocb*    batch[max_iodepth];
+	uint32_t batch_count = 0;
+	AIORequest* held = nullptr; // open-loop modes: prepared, waiting for its intended time
+
+	uint32_t& iodepth;
+	increment_stats_t increment_stats;
+	register_latency_t register_latency;
+
+	// Layout of the ring shared by the kernel (fs/aio.c)
+	struct aio_ring {
+		unsigned id;
+		unsigned nr;
+		unsigned head;
+		unsigned tail;
+		unsigned magic;
+		unsigned compat_features;
+		unsigned incompat_features;
+		unsigned header_length;
+		io_event io_events[0];
+	};
+	static constexpr unsigned aio_ring_magic = 0xa10a10a1;
+
+	public:  // ------------------------------------------------------------
+	// The requests of the context thread_pos (of nthreads) are the workers
+	// thread_pos + slot * nthreads.
+	AIOContext(const std::vector<int>& fds, uint32_t& iodepth_, bool user_reap_,
+	          increment_stats_t increment_stats_, register_latency_t register_latency_,
+	          access_params_t access_params_, offset_released_t offset_released_, Verifier* verifier,
+	          uint32_t thread_pos = 0, uint32_t nthreads = 1)
+	          : user_reap(user_reap_), queues(fds.size(), iodepth_, access_params_),
+	            iodepth(iodepth_), increment_stats(increment_stats_), register_latency(register_latency_)
+	{
+		DEBUG_MSG("constructor");
+
+		memset(&ctx, 0, sizeof(ctx));
+		auto ret = io_setup(max_iodepth, &ctx);
+		if (ret != 0) {
+			throw std::runtime_error(fmt::format("io_setup returned error {}:{}", ret, E2S(ret)).c_str());
+		}
+
+		eventfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (eventfd < 0) {
+			io_destroy(ctx);
+			throw std::runtime_error(fmt::format("eventfd error: {}", strerror(errno)).c_str());
+		}
+
+		if (user_reap && reinterpret_cast<aio_ring*>(ctx)->magic != aio_ring_magic) {
+			spdlog::warn("unknown aio ring format, disabling --aio_user_reap");
+			user_reap = false;
+		}
+
+		request_options.reset(new AIORequest::Options(fds, &ctx, eventfd, &queues, offset_released_, verifier));
+		request_options->worker_first = thread_pos;
+		request_options->worker_step  = nthreads;
+
+		request_list.reset(new std::unique_ptr<AIORequest>[max_iodepth]);
+		for (int i = 0; i < max_iodepth; i++) {
+			request_list[i].reset(new AIORequest(request_options.get()));
+		}
+	}
+
+	~AIOContext() {
+		DEBUG_MSG("destructor");
+
+		if (held != nullptr)
+			held->not_submitted();
+
+		spdlog::info("waiting for pending requests");
+		timespec timeout = {.tv_sec  = 0, .tv_nsec = 300 * 1000 * 1000 };
+		io_event events[max_iodepth];
+		auto ret = io_getevents(ctx, iodepth, max_iodepth, events, &timeout);
+		if (ret < 0) {
+			spdlog::error("io_getevents returned error {}:{}", ret, E2S(ret));
+		}
+		for (int i = 0; i < ret; i++)
+			request_list[i]->active = false;
+
+		DEBUG_MSG("removing request_list");
+		request_list.reset(nullptr);
+
+		DEBUG_MSG("io_destroy(ctx)");
+		ret = io_destroy(ctx);
+		if (ret < 0) {
+			spdlog::error("io_destroy returned error {}:{}", ret, E2S(ret));
+		}
+		close(eventfd);
+	}
+
+	// Submits new requests (if refill) and reaps the completed ones. In the
+	// open-loop modes, a request is submitted at its intended time: the
+	// requests after it are not prepared and the reaping waits until then.
+	void make_requests(bool stop_, bool refill=true) {
+		if (!refill) {
+			pause();
+		} else if (held != nullptr && held->due()) {
+			add_to_batch(held);
+			held = nullptr;
+		}
+		const uint32_t slots = (refill && held == nullptr) ? queues.slots() : 0;
+		for (int i = 0; i < slots; i++ ){
+			auto req = request_list[i].get();
+			if (! req->active && ! req->prepared) {
+				if (! req->prepare())
+					break;
+				if (! req->due()) {
+					held = req;
+					break;
+				}
+				add_to_batch(req);
+			}
+		}
+		submit_batch();
+
+		if (stop_) return;
+
+		uint64_t timeout_ns = 200 * 1000 * 1000;
+		if (held != nullptr)
+			timeout_ns = std::min(timeout_ns, ns_until(held->intended_time));
+		io_event events[max_iodepth];
+		auto nevents = get_events(events, timeout_ns);
+
+		if (stop_) return;
+
+		if (nevents > 0) {
+			Stats stats_sum;
+			auto complete_time = latency_clock::now();
+			for (int i = 0; i < nevents; i++) {
+				if (events[i].data) {
+					auto req = ((AIORequest*) events[i].data);
+					assert(req->pos >= 0 && req->pos < max_iodepth);
+					req->request_finished(events[i].res);
+					stats_sum += req->stats;
+					register_latency({req->write, req->file, req->offset, req->size, req->submit_time, latency_ns(req->submit_time, complete_time)});
+				}
+			}
+			increment_stats(stats_sum);
+		}
+	}
+
+	// Wait mode: the held request is sent when resumed, as a new request.
+	void pause() {
+		if (held != nullptr)
+			held->intended_time = latency_clock::time_point();
+	}
+
+	private: //--------------------------------------------------------------------
+
+	void add_to_batch(AIORequest* req) {
+		req->submit_time = (req->intended_time != latency_clock::time_point()) ? req->intended_time : latency_clock::now();
+		batch[batch_count++] = &req->cb;
+	}
+
+	void submit_batch() {
+		uint32_t done = 0;
+		try {
+			while (done < batch_count) {
+				auto ret = io_submit(ctx, batch_count - done, batch + done);
+				if (ret > 0) {
+					for (int i = 0; i < ret; i++)
+						static_cast<AIORequest*>(batch[done + i]->data)->submitted();
+					done += ret;
+					continue;
+				} else if (ret == 0) {
+					spdlog::warn("aio submit returned 0");
+				} else if (ret == -EINTR || ret == -EAGAIN) {
+					spdlog::warn("aio submit returned {}:{}", ret, E2S(ret));
+				} else {
+					throw std::runtime_error(fmt::format("failed to submit the aio request: {}:{}", ret, E2S(ret)).c_str());
+				}
+				break;
+			}
+		} catch (...) {
+			for (; done < batch_count; done++)
+				static_cast<AIORequest*>(batch[done]->data)->not_submitted();
+			batch_count = 0;
+			throw;
+		}
+		for (; done < batch_count; done++)
+			static_cast<AIORequest*>(batch[done]->data)->not_submitted();
+		batch_count = 0;
+	}
+
+	// Returns the completed events without blocking.
+	int harvest(io_event* events) {
+		if (user_reap) {
+			auto ring = reinterpret_cast<aio_ring*>(ctx);
+			unsigned head = ring->head;
+			unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+			int n = 0;
+			while (head != tail && n < max_iodepth) {
+				events[n++] = ring->io_events[head];
+				head = (head + 1) % ring->nr;
+			}
+			__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+			return n;
+		}
+
+		timespec timeout = {.tv_sec = 0, .tv_nsec = 0};
+		auto ret = io_getevents(ctx, 0, max_iodepth, events, &timeout);
+		if (ret < 0) {
+			if (ret == -EAGAIN || ret == -EINTR) {
+				spdlog::warn("io_getevents returned {}:{}", ret, E2S(ret));
+				return 0;
+			}
+			throw std::runtime_error(fmt::format("io_getevents returned error: {}:{}", ret, E2S(ret)).c_str());
+		}
+		return ret;
+	}
+
+	// Returns the completed events, waiting on the eventfd up to timeout_ns
+	// if there is none.
+	int get_events(io_event* events, uint64_t timeout_ns) {
+		auto n = harvest(events);
+		if (n > 0 || timeout_ns == 0) return n;
+
+		pollfd pfd = {.fd = eventfd, .events = POLLIN, .revents = 0};
+		timespec timeout = {.tv_sec = static_cast<time_t>(timeout_ns / 1000000000), .tv_nsec = static_cast<long>(timeout_ns % 1000000000)};
+		auto ret = ppoll(&pfd, 1, &timeout, nullptr);
+		if (ret < 0) {
+			if (errno == EINTR) return 0;
+			throw std::runtime_error(fmt::format("poll error: {}", strerror(errno)).c_str());
+		} else if (ret == 0) {
+			return 0;
+		}
+
+		uint64_t count;
+		if (read(eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN) // resets the counter
+			throw std::runtime_error(fmt::format("eventfd read error: {}", strerror(errno)).c_str());
+		return harvest(events);
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "AIOEngine::"
+
+// libaio engine. With --aio_threads=1, the controller thread submits and reaps
+// the requests of a single context. Otherwise, each thread has its own context
+// and share of iodepth, placed by --cpus/--numa.
+class AIOEngine : public GenericEngine {
+	std::atomic<bool> wait_ {true};
+	std::atomic<bool> stop  {false};
+
+	const std::vector<int>& fds;
+	uint32_t&          iodepth;
+	const uint32_t     nthreads;
+	const bool         user_reap;
+
+	increment_stats_t  increment_stats;
+	register_latency_t register_latency;
+	access_params_t    access_params;
+	offset_released_t  offset_released;
+	Verifier*          verifier;
+	engine_failed_t    engine_failed;
+
+	std::unique_ptr<AIOContext> context; // nthreads == 1
+	std::unique_ptr<std::unique_ptr<std::thread>[]> threads;
+	std::mutex         exception_mutex;
+	std::exception_ptr thread_exception; // first error of the threads, under exception_mutex
+	std::atomic<bool>  thread_failed {false};
+
+	public:  // ------------------------------------------------------------
+	AIOEngine(const std::vector<int>& fds_, uint32_t& iodepth_, uint32_t nthreads_, bool user_reap_,
+	          increment_stats_t increment_stats_, register_latency_t register_latency_,
+	          access_params_t access_params_, offset_released_t offset_released_, Verifier* verifier_,
+	          engine_failed_t engine_failed_)
+	          : fds(fds_), iodepth(iodepth_), nthreads(nthreads_), user_reap(user_reap_),
+	            increment_stats(increment_stats_), register_latency(register_latency_),
+	            access_params(access_params_), offset_released(offset_released_), verifier(verifier_),
+	            engine_failed(engine_failed_)
+	{
+		DEBUG_MSG("constructor");
+
+		if (nthreads == 1) {
+			context.reset(new AIOContext(fds, iodepth, user_reap, increment_stats, register_latency, access_params, offset_released, verifier));
+			return;
+		}
+
+		spdlog::info("using {} aio threads", nthreads);
+		threads.reset(new std::unique_ptr<std::thread>[nthreads]);
+		for (int i = 0; i < nthreads; i++) {
+			threads[i].reset(new std::thread( [this, i]{this->worker_thread(i);} ));
+		}
+	}
+
+	~AIOEngine() {
+		DEBUG_MSG("destructor");
+		stop = true;
+		if (threads) {
+			for (int i = 0; i < nthreads; i++) {
+				if (threads[i]->joinable())
+					threads[i]->join();
+			}
+			threads.reset(nullptr);
+		}
+	}
+
+	bool is_multithread() {return nthreads > 1;}
+
+	void make_requests(bool& stop_) {
+		if (context) {
+			context->make_requests(stop_);
+			return;
+		}
+
+		if (thread_failed.load(std::memory_order_acquire)) {
+			stop = true;
+			std::lock_guard<std::mutex> lock(exception_mutex);
+			std::rethrow_exception(thread_exception);
+		}
+
+		if (stop_)
+			stop = true;
+		wait_ = false;
+	}
+
+	void wait() {
+		wait_ = true;
+		if (context)
+			context->pause();
+	}
+
+	private: //--------------------------------------------------------------------
+
+	// share of iodepth of the thread pos
+	uint32_t depth_share(int pos) const {
+		uint32_t cur = iodepth;
+		return cur / nthreads + ((pos < cur % nthreads) ? 1 : 0);
+	}
+
+	void worker_thread(int pos) {
+		try {
+			cpu_placement.pin(fmt::format("aio[{}]", pos));
+			auto cpu_guard = cpu_accounting.register_thread(fmt::format("aio[{}]", pos));
+
+			uint32_t depth = depth_share(pos);
+			AIOContext ctx(fds, depth, user_reap, increment_stats, register_latency, access_params, offset_released, verifier, pos, nthreads);
+
+			while (!stop) {
+				depth = depth_share(pos);
+				ctx.make_requests(stop, !wait_); // only reaps in wait mode
+			}
+		} catch (std::exception &e) {
+			DEBUG_MSG("(aio thread[{}]) exception received: {}", pos, e.what());
+			{
+				std::lock_guard<std::mutex> lock(exception_mutex);
+				if (!thread_exception)
+					thread_exception = std::current_exception();
+			}
+			thread_failed.store(true, std::memory_order_release);
+			engine_failed();
+		}
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "UringEngine::"
+
+class UringEngine : public GenericEngine {
+	struct Request {
+		int        pos    = -1;
+		bool       active = false;
+		bool       write  = false;
+		Stats      stats;
+		size_t     size   = 0;
+		int        file   = 0;
+		long long  offset = 0;
+		uint64_t   verify_tag = 0;
+		bool       dsync  = false;
+		latency_clock::time_point intended_time;
+		latency_clock::time_point submit_time;
+	};
+
+	io_uring   ring;
+	bool       ring_ok = false;
+	bool       buffers_registered = false;
+
+	uint32_t&  iodepth;
+	uint32_t   active_count = 0;
+
+	increment_stats_t  increment_stats;
+	register_latency_t register_latency;
+	FileQueues         queues;
+	offset_released_t  offset_released;
+	Verifier*          verifier;
+
+	std::unique_ptr<Request[]>  request_list;
+	Request*   held = nullptr; // open-loop modes: prepared, waiting for its intended time
+	IOBuffer   buffer_mem; // max_iodepth slots of buffer_slot_size bytes
+	size_t     buffer_slot_size = 0;
+
+	public:  // ------------------------------------------------------------
+	UringEngine(const std::vector<int>& fds, uint32_t& iodepth_, bool sqpoll, bool iopoll,
+	            increment_stats_t increment_stats_, register_latency_t register_latency_,
+	            access_params_t access_params_, offset_released_t offset_released_, Verifier* verifier_)
+	          : iodepth(iodepth_), increment_stats(increment_stats_), register_latency(register_latency_),
+	            queues(fds.size(), iodepth_, access_params_), offset_released(offset_released_), verifier(verifier_)
+	{
+		DEBUG_MSG("constructor");
+
+		io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		if (sqpoll) {
+			p.flags |= IORING_SETUP_SQPOLL;
+			p.sq_thread_idle = 1000; // ms
+		}
+		if (iopoll) {
+			p.flags |= IORING_SETUP_IOPOLL;
+		}
+		spdlog::info("io_uring setup with SQPOLL={}, IOPOLL={}", sqpoll, iopoll);
+
+		auto ret = io_uring_queue_init_params(max_iodepth, &ring, &p);
+		if (ret < 0) {
+			throw std::runtime_error(fmt::format("io_uring_queue_init_params returned error {}:{}", ret, E2S(ret)).c_str());
+		}
+		ring_ok = true;
+
+		ret = io_uring_register_files(&ring, fds.data(), fds.size());
+		if (ret < 0) {
+			throw std::runtime_error(fmt::format("io_uring_register_files returned error {}:{}", ret, E2S(ret)).c_str());
+		}
+
+		request_list.reset(new Request[max_iodepth]);
+		for (int i = 0; i < max_iodepth; i++) {
+			request_list[i].pos = i;
+		}
+	}
+
+	~UringEngine() {
+		DEBUG_MSG("destructor");
+		if (!ring_ok) return;
+
+		if (active_count > 0) {
+			spdlog::info("waiting for pending requests");
+			try {
+				Clock wait_clock;
+				while (active_count > 0 && wait_clock.ms() < 300) {
+					reap(10 * 1000 * 1000);
+				}
+			} catch (std::exception& e) {
+				spdlog::error("exception while waiting for pending requests: {}", e.what());
+			}
+			if (active_count > 0)
+				spdlog::warn("{} io_uring requests still active", active_count);
+		}
+
+		DEBUG_MSG("io_uring_queue_exit(ring)");
+		io_uring_queue_exit(&ring);
+	}
+
+	// In the open-loop modes, a request is queued at its intended time: the
+	// requests after it are not prepared and the reaping waits until then.
+	void make_requests(bool& stop_) {
+		unsigned queued = 0;
+		if (held != nullptr && ns_until(held->intended_time) == 0) {
+			if (enqueue(*held))
+				queued++;
+			held = nullptr;
+		}
+		const uint32_t slots = (held == nullptr) ? queues.slots() : 0;
+		for (int i = 0; i < slots; i++) {
+			auto& req = request_list[i];
+			if (! req.active) {
+				if (! prepare(req))
+					break;
+				if (ns_until(req.intended_time) > 0) {
+					held = &req;
+					break;
+				}
+				if (! enqueue(req))
+					break;
+				queued++;
+			}
+		}
+		if (queued > 0)
+			submit();
+
+		if (stop_) return;
+
+		uint64_t timeout_ns = 200 * 1000 * 1000;
+		if (held != nullptr)
+			timeout_ns = std::min(timeout_ns, ns_until(held->intended_time));
+		reap(timeout_ns);
+	}
+
+	// Wait mode: the held request is sent when resumed, as a new request.
+	void wait() {
+		if (held != nullptr)
+			held->intended_time = latency_clock::time_point();
+	}
+
+	private: //--------------------------------------------------------------------
+
+	void register_buffers(size_t size) {
+		assert(size > 0 && size % sizeof(aligned_buffer_t) == 0);
+
+		if (active_count > 0) { // registered buffers can't be replaced while in use
+			DEBUG_MSG("draining {} requests before registering new buffers", active_count);
+			submit();
+			while (active_count > 0)
+				reap(200 * 1000 * 1000);
+		}
+		if (buffers_registered) {
+			auto ret = io_uring_unregister_buffers(&ring);
+			if (ret < 0)
+				throw std::runtime_error(fmt::format("io_uring_unregister_buffers returned error {}:{}", ret, E2S(ret)).c_str());
+			buffers_registered = false;
+		}
+
+		DEBUG_MSG("registering {} buffers of {} bytes", max_iodepth, size);
+		buffer_mem.reset(size * max_iodepth);
+		buffer_slot_size = size;
+
+		iovec iovecs[max_iodepth];
+		for (int i = 0; i < max_iodepth; i++) {
+			iovecs[i].iov_base = buffer_mem.data() + i * size;
+			iovecs[i].iov_len  = size;
+			randomizer.randomize_buffer(buffer_mem.data() + i * size, size);
+		}
+		auto ret = io_uring_register_buffers(&ring, iovecs, max_iodepth);
+		if (ret < 0)
+			throw std::runtime_error(fmt::format("io_uring_register_buffers returned error {}:{}", ret, E2S(ret)).c_str());
+		buffers_registered = true;
+	}
+
+	char* slot_buffer(int pos) {
+		return buffer_mem.data() + pos * buffer_slot_size;
+	}
+
+	bool prepare(Request& req) {
+		assert(!req.active);
+
+		AccessParams params;
+		if (! queues.next(params, req.pos))
+			return false;
+		assert(params.size > 0);
+		if (params.size > buffer_slot_size) {
+			DEBUG_MSG("request size changed from {} to {}", buffer_slot_size, params.size);
+			register_buffers(params.size);
+		} else if (params.write && req.write && !data_pattern.active()) { // randomize 5% of the buffer due to repeated writes
+			randomizer.randomize_buffer(slot_buffer(req.pos), params.size, 20);
+		}
+		if (params.write && data_pattern.active())
+			data_pattern.fill(slot_buffer(req.pos), params.size, randomizer);
+
+		req.stats = Stats{
+			.blocks = 1,
+			.blocks_read  = static_cast<uint64_t>( (!params.write) ? 1 : 0 ),
+			.blocks_write = static_cast<uint64_t>( ( params.write) ? 1 : 0 ),
+			.KB_read  = (!params.write) ? params.block_size : 0,
+			.KB_write = ( params.write) ? params.block_size : 0,
+		};
+		req.write  = params.write;
+		req.size   = params.size;
+		req.file   = params.file;
+		req.offset = params.offset;
+		req.verify_tag = params.verify_tag;
+		req.dsync  = params.dsync;
+		req.intended_time = params.intended_time;
+
+		if (verifier && params.write)
+			verifier->stamp(slot_buffer(req.pos), req.file, req.offset, req.size, req.verify_tag);
+		return true;
+	}
+
+	// Queues the SQE of a prepared request.
+	bool enqueue(Request& req) {
+		auto sqe = io_uring_get_sqe(&ring);
+		if (sqe == nullptr) {
+			spdlog::warn("io_uring submission queue is full");
+			queues.released(req.file);
+			offset_released(req.offset);
+			if (verifier && req.write)
+				verifier->written(req.file, req.offset, req.size, req.verify_tag, false);
+			return false;
+		}
+
+		// with IOSQE_FIXED_FILE, the fd is the index in the registered files
+		if (req.write) {
+			io_uring_prep_write_fixed(sqe, req.file, slot_buffer(req.pos), req.size, req.offset, req.pos);
+			if (req.dsync) {
+				sqe->rw_flags |= RWF_DSYNC;
+			}
+		} else { //read
+			io_uring_prep_read_fixed(sqe, req.file, slot_buffer(req.pos), req.size, req.offset, req.pos);
+		}
+		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+		io_uring_sqe_set_data(sqe, &req);
+		req.submit_time = (req.intended_time != latency_clock::time_point()) ? req.intended_time : latency_clock::now();
+
+		req.active = true;
+		active_count++;
+		return true;
+	}
+
+	void submit() { // one syscall for all prepared requests (none with SQPOLL)
+		auto ret = io_uring_submit(&ring);
+		if (ret < 0) {
+			if (ret == -EINTR || ret == -EAGAIN || ret == -EBUSY) {
+				spdlog::warn("io_uring_submit returned {}:{}", ret, E2S(ret));
+			} else {
+				throw std::runtime_error(fmt::format("failed to submit the io_uring requests: {}:{}", ret, E2S(ret)).c_str());
+			}
+		}
+	}
+
+	void reap(uint64_t timeout_ns) {
+		if (active_count == 0) {
+			std::this_thread::sleep_for(std::chrono::nanoseconds(std::min<uint64_t>(timeout_ns, 1000 * 1000)));
+			return;
+		}
+
+		io_uring_cqe* cqe;
+		__kernel_timespec timeout = {.tv_sec = static_cast<long long>(timeout_ns / 1000000000), .tv_nsec = static_cast<long long>(timeout_ns % 1000000000)};
+		auto ret = io_uring_wait_cqe_timeout(&ring, &cqe, &timeout);
+		if (ret < 0) {
+			if (ret == -ETIME || ret == -EINTR || ret == -EAGAIN)
+				return;
+			throw std::runtime_error(fmt::format("io_uring_wait_cqe_timeout returned error: {}:{}", ret, E2S(ret)).c_str());
+		}
+
+		io_uring_cqe* cqes[max_iodepth];
+		auto ncqes = io_uring_peek_batch_cqe(&ring, cqes, max_iodepth);
+
+		Stats stats_sum;
+		string error; // of the first failed request, thrown after the whole batch is released
+		auto complete_time = latency_clock::now();
+		for (unsigned i = 0; i < ncqes; i++) {
+			// without IORING_FEAT_EXT_ARG, io_uring_wait_cqe_timeout() posts its own timeout requests
+			if (cqes[i]->user_data == LIBURING_UDATA_TIMEOUT) continue;
+			auto req = static_cast<Request*>(io_uring_cqe_get_data(cqes[i]));
+			auto res = cqes[i]->res;
+			if (req == nullptr) continue;
+			assert(req->pos >= 0 && req->pos < max_iodepth);
+			assert(req->active);
+
+			req->active = false;
+			active_count--;
+			queues.released(req->file);
+			offset_released(req->offset);
+			if (verifier && req->write)
+				verifier->written(req->file, req->offset, req->size, req->verify_tag, res == req->size);
+
+			if (res > 0) {
+				const uint64_t KB = static_cast<uint64_t>(res) / 1024; // short at the end of the file
+				if (req->write) req->stats.KB_write = KB;
+				else            req->stats.KB_read  = KB;
+				if (verifier && !req->write && res == req->size)
+					verifier->check(slot_buffer(req->pos), req->file, req->offset, req->size, req->verify_tag, req->stats);
+				stats_sum += req->stats;
+				register_latency({req->write, req->file, req->offset, req->size, req->submit_time, latency_ns(req->submit_time, complete_time)});
+			} else if (res == 0) {
+				spdlog::error("io_uring request[{}] returned zero", req->pos);
+			} else if (res != -EAGAIN && res != -EINTR && error == "") {
+				error = fmt::format("io_uring request[{}] error: {}:{}", req->pos, res, E2S(res));
+			}
+		}
+		io_uring_cq_advance(&ring, ncqes);
+
+		if (ncqes > 0)
+			increment_stats(stats_sum);
+		if (error != "")
+			throw std::runtime_error(error.c_str());
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "Prwv2Engine::"
+
+// One blocking request per worker thread. The pool follows iodepth: threads
+// are created when it grows and exit when it shrinks. Workers only sleep on a
+// condition variable (wait mode), so resuming and reconfiguring take effect
+// immediately.
+class Prwv2Engine : public GenericEngine {
+	std::atomic<bool>     wait_ {true};
+	std::atomic<bool>     stop {false};
+	std::atomic<uint32_t> n_threads {0}; // target size of the pool
+
+	std::mutex              mutex; // taken only to change the state above and to sleep
+	std::condition_variable cv;
+
+	std::vector<std::thread> threads;
+	std::exception_ptr       thread_exception;
+	std::atomic<bool>        thread_failed {false};
+
+	const std::vector<int>& fds;
+	uint32_t& iodepth;
+	const int rw_flags;  // RWF_HIPRI
+	const bool nowait;   // try RWF_NOWAIT first
+	std::atomic<uint64_t> nowait_count {0};
+	std::atomic<uint64_t> nowait_fallbacks {0};
+
+	increment_stats_t  increment_stats;
+	register_latency_t register_latency;
+	access_params_t    access_params;
+	offset_released_t  offset_released;
+	Verifier*          verifier;
+	engine_failed_t    engine_failed;
+
+	void set_state(bool wait, uint32_t n) {
+		std::lock_guard<std::mutex> lock(mutex);
+		wait_ = wait;
+		n_threads = n;
+		cv.notify_all();
+	}
+
+	// Grows the pool, or joins the threads that exited after it shrunk.
+	void resize() {
+		auto n = n_threads.load();
+		while (threads.size() < n) {
+			uint32_t pos = threads.size();
+			DEBUG_MSG("new worker thread {}", pos);
+			threads.emplace_back( [this, pos]{this->worker_thread(pos);} );
+		}
+		while (threads.size() > n) {
+			DEBUG_MSG("join worker thread {}", threads.size() - 1);
+			threads.back().join();
+			threads.pop_back();
+		}
+	}
+
+	// With --prwv2_nowait, the request is sent with RWF_NOWAIT first and
+	// sent again without it if it would block. RWF_NOWAIT may also transfer
+	// only the part that doesn't block: the rest is sent without it.
+	ssize_t submit(bool write, int fd, const iovec* iov, long long offset, int flags) {
+		if (nowait) {
+			nowait_count.fetch_add(1, std::memory_order_relaxed);
+			auto ret = write ? pwritev2(fd, iov, 1, offset, flags | RWF_NOWAIT) : preadv2(fd, iov, 1, offset, flags | RWF_NOWAIT);
+			if (ret > 0 && ret < iov->iov_len) {
+				nowait_fallbacks.fetch_add(1, std::memory_order_relaxed);
+				return submit_rest(write, fd, iov, offset, flags, ret);
+			}
+			if (ret != -1 || (errno != EAGAIN && errno != EOPNOTSUPP))
+				return ret;
+			nowait_fallbacks.fetch_add(1, std::memory_order_relaxed);
+		}
+		return write ? pwritev2(fd, iov, 1, offset, flags) : preadv2(fd, iov, 1, offset, flags);
+	}
+
+	// Sends the bytes of iov after the first done ones. Returns the total, or
+	// -1 (errno) on error.
+	ssize_t submit_rest(bool write, int fd, const iovec* iov, long long offset, int flags, ssize_t done) {
+		while (done < iov->iov_len) {
+			iovec rest = { .iov_base = static_cast<char*>(iov->iov_base) + done, .iov_len = iov->iov_len - done };
+			auto ret = write ? pwritev2(fd, &rest, 1, offset + done, flags) : preadv2(fd, &rest, 1, offset + done, flags);
+			if (ret < 0)  return ret;
+			if (ret == 0) break; // end of file
+			done += ret;
+		}
+		return done;
+	}
+
+	public: //---------------------------------------------------------------------
+	Prwv2Engine(const std::vector<int>& fds_, uint32_t& iodepth_, bool hipri_, bool nowait_,
+	            increment_stats_t increment_stats_, register_latency_t register_latency_,
+	            access_params_t access_params_, offset_released_t offset_released_, Verifier* verifier_,
+	            engine_failed_t engine_failed_)
+	          : fds(fds_), iodepth(iodepth_), rw_flags(hipri_ ? RWF_HIPRI : 0), nowait(nowait_),
+	            increment_stats(increment_stats_), register_latency(register_latency_),
+	            access_params(access_params_),
+				offset_released(offset_released_), verifier(verifier_), engine_failed(engine_failed_)
+	{
+		DEBUG_MSG("constructor");
+		if (hipri_)
+			spdlog::info("prwv2 engine: requests with RWF_HIPRI (polled completions)");
+		if (nowait_)
+			spdlog::info("prwv2 engine: requests with RWF_NOWAIT, falling back to blocking requests");
+	}
+
+	~Prwv2Engine() {
+		DEBUG_MSG("destructor");
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+			cv.notify_all();
+		}
+		for (auto& t: threads) {
+			if (t.joinable())
+				t.join();
+		}
+		if (nowait)
+			spdlog::info("prwv2 engine: {} of {} RWF_NOWAIT requests fell back to blocking requests",
+				nowait_fallbacks.load(), nowait_count.load());
+	}
+
+	bool is_multithread() {return true;}
+
+	void make_requests(bool& stop_) {
+		if (thread_failed) {
+			set_state(true, 0);
+			std::rethrow_exception(thread_exception);
+		}
+		if (stop_) return;
+
+		if (wait_ || n_threads != iodepth) {
+			DEBUG_MSG("running with {} threads", iodepth);
+			set_state(false, iodepth);
+			resize();
+		}
+	}
+
+	void wait() {
+		set_state(true, n_threads);
+	}
+
+	void worker_thread(uint32_t pos) {
+		try {
+			cpu_placement.pin(fmt::format("prwv2[{}]", pos));
+			auto cpu_guard = cpu_accounting.register_thread(fmt::format("prwv2[{}]", pos));
+			size_t cur_size = -1;
+			IOBuffer buffer_mem;
+			char* buffer = nullptr;
+			bool write = false;
+
+			while (true) {
+				if (stop || pos >= n_threads) break;
+				if (wait_) {
+					std::unique_lock<std::mutex> lock(mutex);
+					cv.wait(lock, [this, pos]{ return stop || pos >= n_threads || !wait_; });
+					continue;
+				}
+
+				auto params = access_params(pos);
+				if (params.size == 0) { // no more requests: wait for the engine to stop
+					std::unique_lock<std::mutex> lock(mutex);
+					cv.wait(lock, [this, pos]{ return stop || pos >= n_threads; });
+					continue;
+				}
+				if (cur_size != params.size) {
+					DEBUG_MSG("(posix thread[{}]) request size changed from {} to {}", pos, cur_size, params.size);
+					cur_size = params.size;
+					if (cur_size > buffer_mem.capacity()) { // smaller requests reuse the buffer
+						buffer_mem.reset(cur_size);
+						buffer = buffer_mem.data();
+						randomizer.randomize_buffer(buffer, buffer_mem.capacity());
+					}
+				} else if (params.write && write && !data_pattern.active()) { // randomize 5% of the buffer due to repeated writes
+					randomizer.randomize_buffer(buffer, cur_size, 20);
+				}
+				if (params.write && data_pattern.active())
+					data_pattern.fill(buffer, cur_size, randomizer);
+
+				write = params.write;
+
+				if (verifier && params.write)
+					verifier->stamp(buffer, params.file, params.offset, cur_size, params.verify_tag);
+
+				iovec prw = { .iov_base = buffer, .iov_len = cur_size };
+				ssize_t ret;
+
+				if (params.intended_time != latency_clock::time_point())
+					precise_sleep_until(params.intended_time);
+				auto submit_time = params.start_time();
+				ret = submit(params.write, fds[params.file], &prw, params.offset,
+				             rw_flags | ((params.write && params.dsync) ? RWF_DSYNC : 0));
+				auto complete_time = latency_clock::now();
+				if (verifier && params.write)
+					verifier->written(params.file, params.offset, cur_size, params.verify_tag, ret == cur_size);
+
+				if (stop) break;
+
+				offset_released(params.offset);
+
+				if (ret > 0) {
+					const uint64_t KB = static_cast<uint64_t>(ret) / 1024; // short at the end of the file
+					Stats st = {
+						.blocks = 1,
+						.blocks_read  = static_cast<uint64_t>( (!params.write) ? 1 : 0 ),
+						.blocks_write = static_cast<uint64_t>( ( params.write) ? 1 : 0 ),
+						.KB_read  = (!params.write) ? KB : 0,
+						.KB_write = ( params.write) ? KB : 0,
+					};
+					if (verifier && !params.write && ret == cur_size)
+						verifier->check(buffer, params.file, params.offset, cur_size, params.verify_tag, st);
+					//DEBUG_MSG("st: KB_read={}, KB_write={}", st.KB_read, st.KB_write);
+					increment_stats(st);
+					register_latency({params.write, params.file, params.offset, cur_size, submit_time, latency_ns(submit_time, complete_time)});
+				} else if (ret == 0) {
+					spdlog::error("(posix thread[{}]) read/write returned zero", pos);
+				} else {
+					if (errno != EAGAIN && errno != EINTR)
+						throw std::runtime_error(fmt::format("(posix thread[{}]) read/write error: {}",
+								pos, alutils::strerror2(errno)).c_str());
+				}
+			}
+		} catch (std::exception &e) {
+			DEBUG_MSG("(posix thread[{}]) exception received: {}", pos, e.what());
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!thread_exception)
+					thread_exception = std::current_exception();
+				thread_failed = true;
+				cv.notify_all();
+			}
+			engine_failed();
+		}
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "BlockDistribution::"
+
+// Chooses the block of each random access in O(1). Implementations must be
+// safe to call from several threads (all state is set in the constructor).
+class BlockDistribution {
+	protected:
+	const uint64_t n; // number of blocks
+
+	public: //---------------------------------------------------------------------
+	BlockDistribution(uint64_t n_) : n(n_) {
+		assert(n > 0);
+	}
+	virtual ~BlockDistribution() {}
+	virtual uint64_t next(Randomizer& r) = 0;
+
+	static BlockDistribution* create(const Args& args, uint64_t file_blocks);
+};
+
+class UniformDistribution : public BlockDistribution {
+	public: //---------------------------------------------------------------------
+	UniformDistribution(uint64_t n_) : BlockDistribution(n_) {}
+
+	uint64_t next(Randomizer& r) {
+		return r.uniform(n);
+	}
+};
+
+// Rejection-inversion sampling (W. Hormann and G. Derflinger, "Rejection-inversion
+// to generate variates from monotone discrete distributions", 1996). Only a few
+// constants are precomputed and each sample takes O(1) expected time, with no
+// zeta(n) table. Ranks are optionally scrambled over the file by a bijection
+// k -> k*multiplier mod n, so that the hottest blocks are not adjacent.
+class ZipfianDistribution : public BlockDistribution {
+	const double theta;
+	double h_integral_x1;
+	double h_integral_n;
+	double s;
+	uint64_t multiplier = 1;
+
+	static double helper1(double x) { // log1p(x)/x
+		return (std::abs(x) > 1e-8) ? std::log1p(x) / x : 1.0 - x * (0.5 - x * (1.0/3.0 - 0.25 * x));
+	}
+	static double helper2(double x) { // expm1(x)/x
+		return (std::abs(x) > 1e-8) ? std::expm1(x) / x : 1.0 + x * 0.5 * (1.0 + x * (1.0/3.0) * (1.0 + 0.25 * x));
+	}
+	double h(double x) const {
+		return std::exp(-theta * std::log(x));
+	}
+	double h_integral(double x) const {
+		const double log_x = std::log(x);
+		return helper2((1.0 - theta) * log_x) * log_x;
+	}
+	double h_integral_inverse(double x) const {
+		double t = x * (1.0 - theta);
+		if (t < -1.0) t = -1.0;
+		return std::exp(helper1(t) * x);
+	}
+
+	public: //---------------------------------------------------------------------
+	ZipfianDistribution(uint64_t n_, double theta_, bool scrambled) : BlockDistribution(n_), theta(theta_) {
+		assert(theta > 0.0);
+		h_integral_x1 = h_integral(1.5) - 1.0;
+		h_integral_n  = h_integral(static_cast<double>(n) + 0.5);
+		s = 2.0 - h_integral_inverse(h_integral(2.5) - h(2.0));
+
+		if (scrambled && n > 2) { // the search ends at n - 1 at the latest, always coprime with n
+			multiplier = std::max<uint64_t>(2, UINT64_C(0x9e3779b97f4a7c15) % n);
+			while (std::gcd(multiplier, n) != 1)
+				multiplier++;
+		}
+	}
+
+	uint64_t next(Randomizer& r) {
+		uint64_t k;
+		while (true) {
+			const double u = h_integral_n + r.uniform_real() * (h_integral_x1 - h_integral_n);
+			const double x = h_integral_inverse(u);
+			double kd = std::floor(x + 0.5);
+			if (kd < 1.0)
+				kd = 1.0;
+			else if (kd > static_cast<double>(n))
+				kd = static_cast<double>(n);
+			k = static_cast<uint64_t>(kd);
+			if (kd - x <= s || u >= h_integral(kd + 0.5) - h(kd))
+				break;
+		}
+		// rank k (1 = hottest) to block
+		return static_cast<uint64_t>((static_cast<unsigned __int128>(k - 1) * multiplier) % n);
+	}
+};
+
+// A fraction access_ratio of the accesses goes to a window of hot_blocks and the
+// rest to the other blocks. With speed > 0, the window start moves forward
+// (wrapping around the file) by speed*n blocks per second.
+class HotspotDistribution : public BlockDistribution {
+	const uint64_t hot_blocks;
+	const double   access_ratio;
+	const double   blocks_per_ns;
+	const latency_clock::time_point start_time;
+
+	public: //---------------------------------------------------------------------
+	HotspotDistribution(uint64_t n_, double access_ratio_, double size_ratio, double speed)
+		: BlockDistribution(n_),
+		  hot_blocks(std::max<uint64_t>(1, std::min<uint64_t>(n_, size_ratio * n_))),
+		  access_ratio(access_ratio_),
+		  blocks_per_ns(speed * n_ / 1e9),
+		  start_time(latency_clock::now()) {}
+
+	uint64_t next(Randomizer& r) {
+		uint64_t window_start = 0;
+		if (blocks_per_ns > 0.0) {
+			window_start = static_cast<uint64_t>(blocks_per_ns * latency_ns(start_time, latency_clock::now())) % n;
+		}
+
+		uint64_t b;
+		if (hot_blocks >= n || r.uniform_real() < access_ratio)
+			b = r.uniform(hot_blocks);
+		else
+			b = hot_blocks + r.uniform(n - hot_blocks);
+		return (window_start + b) % n;
+	}
+};
+
+BlockDistribution* BlockDistribution::create(const Args& args, uint64_t file_blocks) {
+	if (args.distribution == "uniform") {
+		return new UniformDistribution(file_blocks);
+	} else if (args.distribution == "zipfian") {
+		return new ZipfianDistribution(file_blocks, args.zipf_theta, args.zipf_scrambled);
+	} else if (args.distribution == "hotspot") {
+		return new HotspotDistribution(file_blocks, args.hotspot_access, args.hotspot_size, 0.0);
+	} else if (args.distribution == "moving_hotspot") {
+		return new HotspotDistribution(file_blocks, args.hotspot_access, args.hotspot_size, args.hotspot_speed);
+	}
+	throw std::runtime_error(fmt::format("invalid distribution: {}", args.distribution).c_str());
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "SizeMix::"
+
+// Weighted distribution of request sizes, parsed from "<KiB>:<weight>,...".
+class SizeMix {
+	std::vector<uint64_t> sizes;      // B
+	std::vector<double>   cumulative; // normalized to 1.0
+
+	public: //---------------------------------------------------------------------
+	SizeMix(const string& spec, uint64_t fs_block_size) {
+		DEBUG_MSG("constructor, spec={}", spec);
+		double total = 0.0;
+		for (auto& i: Args::parseSizeMix(spec, fs_block_size)) {
+			total += i.second;
+			sizes.push_back(i.first);
+			cumulative.push_back(total);
+		}
+		for (auto& i: cumulative)
+			i /= total;
+	}
+
+	uint64_t next(Randomizer& r) const {
+		if (sizes.size() == 1) return sizes[0];
+		double u = r.uniform_real();
+		for (uint32_t i = 0; i < sizes.size() - 1; i++) {
+			if (u < cumulative[i])
+				return sizes[i];
+		}
+		return sizes.back();
+	}
+
+	const std::vector<uint64_t>& all() const { return sizes; }
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "Lock::"
+
+class Lock {
+	bool active = false;
+	std::atomic_flag lock_flag = ATOMIC_FLAG_INIT;
+
+	public: //---------------------------------------------------------------------
+
+	Lock() {}
+	Lock(bool active_) : active(active_) {}
+	void activate() {active = true;}
+
+	// https://en.cppreference.com/w/cpp/atomic/atomic_flag
+	void lock() {
+		if (!active) return;
+
+		while (lock_flag.test_and_set(std::memory_order_acquire)) {  // acquire lock
+#			if defined(__cpp_lib_atomic_flag_test)
+			while (lock_flag.test(std::memory_order_relaxed))        // test lock
+#			endif
+			{
+				std::this_thread::yield(); // yield
+			}
+		}
+	}
+	void unlock() {
+		if (!active) return;
+		lock_flag.clear(std::memory_order_release);
+	}
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "RateScheduler::"
+
+// Open-loop request scheduler. Every request takes the next send time from a
+// virtual clock that advances by the request's share of the target rate
+// (constant or exponential inter-arrival times). The clock never skips, so
+// requests delayed by a slow device queue up behind their intended times.
+class RateScheduler {
+	const double   iops;
+	const double   bytes_per_s;
+	const bool     poisson;
+	const latency_clock::time_point base_time;
+	std::atomic<uint64_t> next_ns {0}; // relative to base_time
+
+	public: //---------------------------------------------------------------------
+	RateScheduler(double rate_iops, double rate_mbps, bool poisson_)
+		: iops(rate_iops), bytes_per_s(rate_mbps * 1024 * 1024), poisson(poisson_),
+		  base_time(latency_clock::now())
+	{
+		assert(iops > 0.0 || bytes_per_s > 0.0);
+	}
+
+	latency_clock::time_point next(uint64_t size, Randomizer& r) {
+		double interval_s = 0.0;
+		if (iops > 0.0)
+			interval_s = 1.0 / iops;
+		if (bytes_per_s > 0.0)
+			interval_s = std::max(interval_s, static_cast<double>(size) / bytes_per_s);
+		if (poisson)
+			interval_s *= -std::log(1.0 - r.uniform_real());
+
+		auto t = next_ns.fetch_add(static_cast<uint64_t>(interval_s * 1e9), std::memory_order_relaxed);
+		return base_time + std::chrono::nanoseconds(t);
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "IOCapture::"
+
+// Capture file (--io_capture): a header followed by fixed-size little-endian
+// records, in flush order (not sorted by time). See access_time3_capture.py.
+struct IOCaptureHeader {
+	char     magic[8];       // "AT3CAPT"
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t start_epoch_ns; // wall clock time of time_ns = 0
+	uint64_t reserved;
+};
+static_assert(sizeof(IOCaptureHeader) == 32, "unexpected size of IOCaptureHeader");
+
+struct IOCaptureRecord {
+	uint64_t time_ns;    // submission time, relative to the start of the capture
+	uint64_t offset;     // bytes, in the file
+	uint64_t latency_ns;
+	uint32_t size;       // bytes
+	uint16_t thread;     // ring of the thread that completed the request
+	uint8_t  file;       // index in the list of files (--filename)
+	uint8_t  op;         // 0 = read, 1 = write, 2 = discard
+};
+static_assert(sizeof(IOCaptureRecord) == 32, "unexpected size of IOCaptureRecord");
+
+// Records every completed request. Each thread appends to its own
+// single-producer ring and a flusher thread drains the rings to the file. When
+// a ring is full the record is dropped and counted, so the capture never
+// blocks an engine. Rings of finished threads are reused by new threads, like
+// the shards of StatsCollector.
+class IOCapture {
+	static constexpr uint32_t max_rings = 4 * max_iodepth;
+	static constexpr char     magic[8]  = "AT3CAPT";
+	static constexpr uint32_t version   = 1;
+	static constexpr std::chrono::milliseconds flush_interval {100};
+
+	struct alignas(64) Ring {
+		const uint16_t index;
+		const uint64_t mask;
+		std::unique_ptr<IOCaptureRecord[]> records;
+
+		alignas(64) std::atomic<uint64_t> head {0}; // written by the producer
+		std::atomic<uint64_t>             drops {0};
+		alignas(64) std::atomic<uint64_t> tail {0}; // written by the flusher
+		std::atomic<bool>                 in_use {true};
+
+		Ring(uint16_t index_, uint64_t size) : index(index_), mask(size - 1), records(new IOCaptureRecord[size]) {}
+	};
+
+	struct LocalRing {
+		uint64_t capture_id = 0;
+		Ring*    ring       = nullptr;
+		~LocalRing() {
+			if (ring != nullptr)
+				ring->in_use.store(false, std::memory_order_release);
+		}
+	};
+
+	static std::atomic<uint64_t> instance_count;
+	const uint64_t instance_id;
+	const string   filename;
+	const uint64_t ring_size; // records, power of 2
+	const latency_clock::time_point start_time;
+
+	std::mutex            rings_mutex; // only taken when a thread gets its ring
+	std::atomic<Ring*>    rings[max_rings];
+	std::atomic<uint32_t> n_rings {0};
+
+	FILE*                   file = nullptr;
+	uint64_t                records_written = 0;
+	std::thread             flusher_thread;
+	std::exception_ptr      flusher_exception;
+	std::atomic<bool>       flusher_failed {false};
+	std::mutex              stop_mutex;
+	std::condition_variable stop_cv;
+	bool                    stop_ = false;
+
+	Ring& local() {
+		thread_local LocalRing cached;
+		if (cached.capture_id != instance_id) {
+			cached.ring       = acquire_ring();
+			cached.capture_id = instance_id;
+		}
+		return *cached.ring;
+	}
+
+	Ring* acquire_ring() {
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		auto n = n_rings.load(std::memory_order_relaxed);
+		for (uint32_t i = 0; i < n; i++) {
+			auto r = rings[i].load(std::memory_order_relaxed);
+			bool expected = false;
+			if (r->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+				DEBUG_MSG("reusing ring {}", i);
+				return r;
+			}
+		}
+		if (n >= max_rings)
+			throw std::runtime_error(fmt::format("too many threads using the I/O capture (max {})", max_rings).c_str());
+		DEBUG_MSG("new ring {}", n);
+		auto r = new Ring(n, ring_size);
+		rings[n].store(r, std::memory_order_relaxed);
+		n_rings.store(n + 1, std::memory_order_release);
+		return r;
+	}
+
+	void write_records(const IOCaptureRecord* rec, uint64_t count) {
+		if (count == 0) return;
+		if (fwrite(rec, sizeof(IOCaptureRecord), count, file) != count)
+			throw std::runtime_error(fmt::format("error writing the capture file {}: {}", filename, alutils::strerror2(errno)).c_str());
+		records_written += count;
+	}
+
+	void flush_rings() {
+		auto n = n_rings.load(std::memory_order_acquire);
+		for (uint32_t i = 0; i < n; i++) {
+			auto& r = *rings[i].load(std::memory_order_relaxed);
+			auto t = r.tail.load(std::memory_order_relaxed);
+			auto h = r.head.load(std::memory_order_acquire);
+			if (h == t) continue;
+			uint64_t begin = t & r.mask;
+			uint64_t count = h - t;
+			uint64_t first = std::min<uint64_t>(count, ring_size - begin); // until the end of the ring
+			write_records(r.records.get() + begin, first);
+			write_records(r.records.get(), count - first);
+			r.tail.store(h, std::memory_order_release);
+		}
+	}
+
+	void flusherMain() noexcept {
+		DEBUG_MSG("flusher thread initiated");
+		try {
+			std::unique_lock<std::mutex> lock(stop_mutex);
+			bool last = false;
+			while (!last) {
+				stop_cv.wait_for(lock, flush_interval, [this]{ return stop_; });
+				last = stop_; // one more pass after the stop
+				lock.unlock();
+				flush_rings();
+				lock.lock();
+			}
+			if (fflush(file) != 0)
+				throw std::runtime_error(fmt::format("error writing the capture file {}: {}", filename, alutils::strerror2(errno)).c_str());
+		} catch (std::exception& e) {
+			DEBUG_MSG("exception received: {}", e.what());
+			flusher_exception = std::current_exception();
+			flusher_failed.store(true, std::memory_order_release);
+		}
+		DEBUG_MSG("flusher thread finished");
+	}
+
+	public: //---------------------------------------------------------------------
+	IOCapture(const string& filename_, uint64_t ring_size_)
+		: instance_id(++instance_count), filename(filename_), ring_size(ring_size_),
+		  start_time(latency_clock::now())
+	{
+		DEBUG_MSG("constructor");
+		assert(ring_size > 0 && (ring_size & (ring_size - 1)) == 0);
+		for (auto& i: rings)
+			i.store(nullptr, std::memory_order_relaxed);
+
+		file = fopen(filename.c_str(), "wb");
+		if (file == nullptr)
+			throw std::runtime_error(fmt::format("can't create the capture file {}: {}", filename, alutils::strerror2(errno)).c_str());
+		setvbuf(file, nullptr, _IOFBF, 4 * 1024 * 1024);
+
+		IOCaptureHeader header {};
+		memcpy(header.magic, magic, sizeof(header.magic));
+		header.version        = version;
+		header.record_size    = sizeof(IOCaptureRecord);
+		header.start_epoch_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		if (fwrite(&header, sizeof(header), 1, file) != 1) {
+			fclose(file);
+			throw std::runtime_error(fmt::format("error writing the capture file {}: {}", filename, alutils::strerror2(errno)).c_str());
+		}
+
+		spdlog::info("capturing the I/O requests to {} ({} records per thread)", filename, ring_size);
+		flusher_thread = std::thread( [this]{this->flusherMain();} );
+	}
+
+	~IOCapture() {
+		DEBUG_MSG("destructor");
+		{
+			std::lock_guard<std::mutex> lock(stop_mutex);
+			stop_ = true;
+			stop_cv.notify_all();
+		}
+		if (flusher_thread.joinable())
+			flusher_thread.join();
+		fclose(file);
+
+		uint64_t dropped = 0;
+		auto n = n_rings.load(std::memory_order_acquire);
+		for (uint32_t i = 0; i < n; i++) {
+			auto r = rings[i].load(std::memory_order_relaxed);
+			dropped += r->drops.load(std::memory_order_relaxed);
+			delete r;
+		}
+		spdlog::info("I/O capture finished: {} records written to {}, {} dropped", records_written, filename, dropped);
+	}
+
+	inline void record(const IOCompletion& io) {
+		auto& r = local();
+		auto h = r.head.load(std::memory_order_relaxed);
+		if (h - r.tail.load(std::memory_order_acquire) >= ring_size) { // full
+			r.drops.store(r.drops.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			return;
+		}
+		auto& rec = r.records[h & r.mask];
+		rec.time_ns    = (io.submit_time > start_time) ? latency_ns(start_time, io.submit_time) : 0;
+		rec.offset     = io.offset;
+		rec.latency_ns = io.latency_ns;
+		rec.size       = io.size;
+		rec.thread     = r.index;
+		rec.file       = io.file;
+		rec.op         = io.discard ? 2 : (io.write ? 1 : 0);
+		r.head.store(h + 1, std::memory_order_release);
+	}
+
+	// Records dropped so far. Rethrows the errors of the flusher thread.
+	uint64_t drops() const {
+		if (flusher_failed.load(std::memory_order_acquire))
+			std::rethrow_exception(flusher_exception);
+		uint64_t ret = 0;
+		auto n = n_rings.load(std::memory_order_acquire);
+		for (uint32_t i = 0; i < n; i++)
+			ret += rings[i].load(std::memory_order_relaxed)->drops.load(std::memory_order_relaxed);
+		return ret;
+	}
+};
+std::atomic<uint64_t> IOCapture::instance_count {0};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "TraceParser::"
+
+struct TraceRecord {
+	uint64_t time_ns; // relative to the beginning of the trace
+	uint64_t offset;  // bytes
+	uint32_t size;    // bytes
+	bool     write;
+};
+
+// Sequential reader of one trace format. Requests other than reads and
+// writes (flushes, discards, ...) are skipped.
+class TraceParser {
+	protected:
+	std::string filename;
+	FILE*       file = nullptr;
+	uint64_t    line_number = 0;
+	static constexpr uint32_t line_size = 1024;
+	char        line[line_size];
+
+	bool next_line() {
+		if (fgets(line, line_size, file) == nullptr) {
+			if (ferror(file))
+				throw std::runtime_error(fmt::format("error reading trace file {}: {}", filename, alutils::strerror2(errno)).c_str());
+			return false;
+		}
+		line_number++;
+		return true;
+	}
+
+	public: //---------------------------------------------------------------------
+	TraceParser(const std::string& filename_) : filename(filename_) {
+		file = fopen(filename.c_str(), "r");
+		if (file == nullptr)
+			throw std::runtime_error(fmt::format("can't open trace file {}: {}", filename, alutils::strerror2(errno)).c_str());
+		setvbuf(file, nullptr, _IOFBF, 4 * 1024 * 1024);
+	}
+	virtual ~TraceParser() {
+		if (file != nullptr)
+			fclose(file);
+	}
+	virtual bool next(TraceRecord& rec) = 0;
+
+	static TraceParser* create(const std::string& format, const std::string& filename);
+};
+
+// fio iolog versions 2 and 3 (https://fio.readthedocs.io, "I/O Replay").
+// Version 2 has no timestamps, so it is always replayed as fast as possible.
+class FioTraceParser : public TraceParser {
+	int version = 0;
+
+	public: //---------------------------------------------------------------------
+	FioTraceParser(const std::string& filename_) : TraceParser(filename_) {
+		if (next_line()) {
+			if (strncmp(line, "fio version 2 iolog", 19) == 0)
+				version = 2;
+			else if (strncmp(line, "fio version 3 iolog", 19) == 0)
+				version = 3;
+		}
+		if (version == 0)
+			throw std::runtime_error(fmt::format("trace file {} is not a fio iolog (version 2 or 3)", filename).c_str());
+	}
+
+	bool next(TraceRecord& rec) {
+		char action[32];
+		unsigned long long timestamp_ms = 0, offset, size;
+		while (next_line()) {
+			int n;
+			if (version == 2)
+				n = sscanf(line, "%*s %31s %llu %llu", action, &offset, &size) + 1;
+			else
+				n = sscanf(line, "%llu %*s %31s %llu %llu", &timestamp_ms, action, &offset, &size);
+			if (n < 4) continue; // add, open, close, ...
+
+			bool write = (strcmp(action, "write") == 0);
+			if (!write && strcmp(action, "read") != 0) continue; // sync, trim, wait, ...
+
+			rec.time_ns = timestamp_ms * 1000 * 1000;
+			rec.offset  = offset;
+			rec.size    = size;
+			rec.write   = write;
+			return true;
+		}
+		return false;
+	}
+};
+
+// Default text output of blkparse. Only queue (Q) events are replayed, as fio does.
+//   8,0    3        1     0.000000000   697  Q  WS 223490 + 8 [kjournald]
+class BlkparseTraceParser : public TraceParser {
+	public: //---------------------------------------------------------------------
+	BlkparseTraceParser(const std::string& filename_) : TraceParser(filename_) {}
+
+	bool next(TraceRecord& rec) {
+		char action[8], rwbs[8];
+		double time_s;
+		unsigned long long sector, sectors;
+		while (next_line()) {
+			if (sscanf(line, "%*s %*s %*s %lf %*s %7s %7s %llu + %llu", &time_s, action, rwbs, &sector, &sectors) != 5)
+				continue;
+			if (strcmp(action, "Q") != 0 || sectors == 0) continue;
+
+			bool write = (strchr(rwbs, 'W') != nullptr);
+			bool read  = (strchr(rwbs, 'R') != nullptr);
+			if (!write && !read) continue;     // flush, discard, ...
+			if (strchr(rwbs, 'D') != nullptr) continue; // discard
+
+			rec.time_ns = static_cast<uint64_t>(time_s * 1e9);
+			rec.offset  = sector * 512;
+			rec.size    = sectors * 512;
+			rec.write   = write;
+			return true;
+		}
+		return false;
+	}
+};
+
+TraceParser* TraceParser::create(const std::string& format, const std::string& filename) {
+	if (format == "fio")
+		return new FioTraceParser(filename);
+	else if (format == "blkparse")
+		return new BlkparseTraceParser(filename);
+	throw std::runtime_error(fmt::format("invalid trace format: {}", format).c_str());
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "TraceReplay::"
+
+// Streams a trace file through a double buffer: a reader thread parses the
+// next chunk of records while the engines consume the current one. Offsets
+// are rescaled from the trace extent to the target file size and aligned
+// for O_DIRECT.
+class TraceReplay {
+	typedef std::vector<TraceRecord> Chunk;
+	static constexpr uint32_t chunk_records = 64 * 1024;
+	static constexpr uint32_t max_chunks    = 2;
+	static constexpr uint64_t alignment     = 4096;
+
+	const std::string format;
+	const std::string filename;
+	const double      speed;     // 0 = as fast as possible
+	const bool        loop;
+	const uint64_t    file_size; // bytes
+	uint64_t          trace_extent; // bytes
+	double            scale = 1.0;
+
+	std::thread        reader_thread;
+	std::exception_ptr reader_exception;
+	std::atomic<bool>  stop_ {false};
+
+	std::mutex              chunks_mutex;
+	std::condition_variable chunks_cv;
+	std::deque<std::unique_ptr<Chunk>> chunks;
+	bool                    reader_finished = false;
+
+	// consumer side (protected by consumer_mutex)
+	std::mutex             consumer_mutex;
+	std::unique_ptr<Chunk> cur_chunk;
+	uint32_t               cur_index = 0;
+	bool                   finished = false;
+	uint64_t               base_time_ns = 0;  // time of the first record of the current pass
+	uint64_t               pass_offset_ns = 0; // accumulated duration of the previous passes
+	uint64_t               last_time_ns = 0;
+	latency_clock::time_point start_time;
+	bool                   started = false;
+	latency_clock::time_point pause_time;
+	bool                   paused = false;
+
+	uint64_t scan_extent() {
+		spdlog::info("scanning trace file {} to find its extent", filename);
+		std::unique_ptr<TraceParser> parser(TraceParser::create(format, filename));
+		TraceRecord rec;
+		uint64_t ret = 0, count = 0;
+		while (parser->next(rec)) {
+			ret = std::max<uint64_t>(ret, rec.offset + rec.size);
+			count++;
+		}
+		spdlog::info("trace file has {} requests and an extent of {} MiB", count, ret / 1024 / 1024);
+		if (count == 0)
+			throw std::runtime_error(fmt::format("trace file {} has no read/write requests", filename).c_str());
+		return ret;
+	}
+
+	void readerMain() noexcept {
+		try {
+			do {
+				std::unique_ptr<TraceParser> parser(TraceParser::create(format, filename));
+				bool eof = false;
+				while (!stop_ && !eof) {
+					std::unique_ptr<Chunk> chunk(new Chunk());
+					chunk->reserve(chunk_records);
+					TraceRecord rec;
+					while (chunk->size() < chunk_records) {
+						if (! parser->next(rec)) {
+							eof = true;
+							break;
+						}
+						chunk->push_back(rec);
+					}
+					if (chunk->size() == 0) break;
+
+					std::unique_lock<std::mutex> lock(chunks_mutex);
+					chunks_cv.wait(lock, [this]{ return stop_ || chunks.size() < max_chunks; });
+					chunks.push_back(std::move(chunk));
+					chunks_cv.notify_all();
+				}
+				if (eof)
+					DEBUG_MSG("end of trace file");
+			} while (!stop_ && loop);
+		} catch (std::exception& e) {
+			DEBUG_MSG("exception received: {}", e.what());
+			reader_exception = std::current_exception();
+		}
+		std::lock_guard<std::mutex> lock(chunks_mutex);
+		reader_finished = true;
+		chunks_cv.notify_all();
+	}
+
+	bool next_chunk() {
+		std::unique_lock<std::mutex> lock(chunks_mutex);
+		chunks_cv.wait(lock, [this]{ return chunks.size() > 0 || reader_finished; });
+		if (reader_exception)
+			std::rethrow_exception(reader_exception);
+		if (chunks.size() == 0)
+			return false;
+		cur_chunk = std::move(chunks.front());
+		chunks.pop_front();
+		cur_index = 0;
+		chunks_cv.notify_all();
+		return true;
+	}
+
+	public: //---------------------------------------------------------------------
+	TraceReplay(const Args& args, uint64_t file_size_)
+		: format(args.trace_format), filename(args.trace_file), speed(args.trace_speed),
+		  loop(args.trace_loop), file_size(file_size_)
+	{
+		DEBUG_MSG("constructor");
+		trace_extent = (args.trace_extent > 0) ? args.trace_extent * 1024 * 1024 : scan_extent();
+		if (trace_extent > file_size)
+			scale = static_cast<double>(file_size) / static_cast<double>(trace_extent);
+		spdlog::info("replaying trace file {} (format {}, speed {}, offset scale {:.4f})", filename, format, speed, scale);
+
+		reader_thread = std::thread( [this]{this->readerMain();} );
+	}
+
+	~TraceReplay() {
+		DEBUG_MSG("destructor");
+		{
+			std::lock_guard<std::mutex> lock(chunks_mutex);
+			stop_ = true;
+			chunks_cv.notify_all();
+		}
+		if (reader_thread.joinable())
+			reader_thread.join();
+	}
+
+	// Returns false at the end of the trace. due_time is the moment the
+	// request must be issued (it is in the past when replaying at full speed).
+	bool next(TraceRecord& rec, latency_clock::time_point& due_time) {
+		std::lock_guard<std::mutex> lock(consumer_mutex);
+		if (finished) return false;
+
+		if (!cur_chunk || cur_index >= cur_chunk->size()) {
+			if (! next_chunk()) {
+				spdlog::info("end of trace replay");
+				finished = true;
+				return false;
+			}
+		}
+		rec = (*cur_chunk)[cur_index++];
+
+		if (!started) {
+			started = true;
+			start_time = latency_clock::now();
+			base_time_ns = rec.time_ns;
+		} else if (rec.time_ns < last_time_ns && loop) { // new pass of the trace
+			pass_offset_ns += last_time_ns - base_time_ns;
+			base_time_ns = rec.time_ns;
+		}
+		last_time_ns = rec.time_ns;
+
+		if (speed > 0.0) {
+			double rel_ns = static_cast<double>(pass_offset_ns + rec.time_ns - std::min(base_time_ns, rec.time_ns)) / speed;
+			due_time = start_time + std::chrono::nanoseconds(static_cast<uint64_t>(rel_ns));
+		} else {
+			due_time = start_time;
+		}
+
+		// rescale and align
+		uint64_t size = ((rec.size + alignment -1) / alignment) * alignment;
+		if (size > file_size) size = file_size - (file_size % alignment);
+		uint64_t offset = static_cast<uint64_t>(static_cast<double>(rec.offset) * scale);
+		offset -= offset % alignment;
+		if (offset + size > file_size)
+			offset = file_size - size - ((file_size - size) % alignment);
+		rec.offset = offset;
+		rec.size   = size;
+
+		return true;
+	}
+
+	// Keeps the replay clock stopped while the engine is in wait mode.
+	void pause() {
+		std::lock_guard<std::mutex> lock(consumer_mutex);
+		if (paused) return;
+		paused = true;
+		pause_time = latency_clock::now();
+	}
+
+	void resume() {
+		std::lock_guard<std::mutex> lock(consumer_mutex);
+		if (!paused) return;
+		paused = false;
+		start_time += latency_clock::now() - pause_time;
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "StripeMap::"
+
+// Logical address space of the experiment over one or more files, striped
+// like a RAID0. Each stripe row holds weights[f] stripe units of file f,
+// interleaved (f0, f1, ..., f0, f1, ...) so that the files with more weight
+// receive proportionally more accesses. With a single file, the logical
+// address is the file offset.
+class StripeMap {
+	const uint64_t stripe_size;         // B
+	const uint64_t block_size;          // B, of the file system
+	std::vector<uint32_t> weights;
+	std::vector<int>      row_file;     // file of each stripe unit of a row
+	std::vector<uint64_t> row_unit;     // unit of the file inside the row
+	uint64_t rows  = 0;
+	uint64_t size_ = 0;                 // B
+
+	public: //---------------------------------------------------------------------
+	StripeMap(const std::vector<uint64_t>& file_sizes, uint64_t stripe_size_, uint64_t fs_block_size, const string& weights_str)
+		: stripe_size(stripe_size_), block_size(fs_block_size)
+	{
+		DEBUG_MSG("constructor");
+		assert(file_sizes.size() > 0);
+
+		if (file_sizes.size() == 1) {
+			weights.push_back(1);
+			size_ = file_sizes[0];
+			return;
+		}
+
+		if (stripe_size % fs_block_size != 0)
+			throw std::runtime_error(fmt::format("--stripe_size must be multiple of filesystem's block size ({} B)", fs_block_size).c_str());
+
+		if (weights_str != "") {
+			for (auto& i: alutils::split_str(weights_str, ","))
+				weights.push_back(std::stoul(i));
+			if (weights.size() != file_sizes.size())
+				throw std::runtime_error(fmt::format("--stripe_weights must have one value per file ({})", file_sizes.size()).c_str());
+		} else {
+			weights.resize(file_sizes.size(), 1);
+		}
+
+		auto max_weight = *std::max_element(weights.begin(), weights.end());
+		std::vector<uint64_t> count(weights.size(), 0);
+		for (uint32_t j = 0; j < max_weight; j++) {
+			for (int f = 0; f < weights.size(); f++) {
+				if (weights[f] > j) {
+					row_file.push_back(f);
+					row_unit.push_back(count[f]++);
+				}
+			}
+		}
+
+		rows = std::numeric_limits<uint64_t>::max();
+		for (int f = 0; f < file_sizes.size(); f++)
+			rows = std::min<uint64_t>(rows, file_sizes[f] / (weights[f] * stripe_size));
+		if (rows == 0)
+			throw std::runtime_error("the files are smaller than a stripe row (see --stripe_size and --stripe_weights)");
+
+		size_ = rows * row_file.size() * stripe_size;
+		spdlog::info("striping {} files: stripe_size={} KiB, weights={}, {} rows, {} MiB",
+			file_sizes.size(), stripe_size / 1024, weights_str != "" ? weights_str : "1", rows, size_ / 1024 / 1024);
+	}
+
+	uint64_t size() const { return size_; }
+
+	// Translates params.offset from the logical address space to the
+	// file and offset of the request. A request crossing a stripe unit
+	// boundary is kept whole in the file of its first byte.
+	void map(AccessParams& params) const {
+		if (row_file.size() == 0) return;
+
+		uint64_t unit = params.offset / stripe_size;
+		uint64_t row  = unit / row_file.size();
+		uint64_t pos  = unit % row_file.size();
+		int f = row_file[pos];
+		uint64_t offset = ((row * weights[f] + row_unit[pos]) * stripe_size) + (params.offset % stripe_size);
+		uint64_t file_end = rows * weights[f] * stripe_size;
+		if (offset + params.size > file_end)
+			offset = (file_end - params.size) / block_size * block_size; // O_DIRECT alignment
+
+		params.file   = f;
+		params.offset = offset;
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "Preconditioner::"
+
+// Write preconditioning before the measured workload (--precondition), as in
+// the SNIA Solid State Storage Performance Test Specification: a sequential
+// write pass over the whole address space followed by rounds of uniform
+// random overwrites (--precondition_round seconds each). Steady state is
+// reached when, in the last --precondition_window rounds, both the write IOPS
+// and the average write latency have a range within --precondition_excursion
+// and a least squares line whose excursion is within --precondition_slope,
+// relative to the window average.
+class Preconditioner {
+	public: //---------------------------------------------------------------------
+	enum Phase { phase_fill, phase_random, phase_done };
+
+	private: //--------------------------------------------------------------------
+	Args*           args;
+	StatsCollector& stats;
+	const uint64_t  block_size; // B
+	const uint64_t  blocks;     // of the logical address space
+
+	std::atomic<int>      phase {phase_fill};
+	std::atomic<uint64_t> fill_block {0};
+	Clock                 clock;
+
+	std::thread             thread;
+	std::mutex              stop_mutex;
+	std::condition_variable stop_cv;
+	bool                    stop_ = false;
+
+	struct Round {
+		double iops;
+		double lat_avg_us;
+	};
+
+	bool steady(const std::deque<Round>& window, double Round::* value) const {
+		const double n = window.size();
+		double avg = 0.0, min = std::numeric_limits<double>::max(), max = 0.0;
+		for (auto& r: window) {
+			avg += r.*value / n;
+			min  = std::min(min, r.*value);
+			max  = std::max(max, r.*value);
+		}
+		if (avg <= 0.0) return false;
+
+		double x_avg = (n - 1.0) / 2.0, sxy = 0.0, sxx = 0.0;
+		for (uint32_t i = 0; i < window.size(); i++) {
+			sxy += (i - x_avg) * (window[i].*value - avg);
+			sxx += (i - x_avg) * (i - x_avg);
+		}
+		double slope_excursion = std::fabs(sxy / sxx) * (n - 1.0);
+
+		return (max - min) <= args->precondition_excursion * avg && slope_excursion <= args->precondition_slope * avg;
+	}
+
+	void finish(bool steady_state) {
+		phase = phase_done;
+		if (steady_state)
+			spdlog::info("precondition: steady state reached after {} seconds", clock.s());
+		else
+			spdlog::warn("precondition: steady state NOT reached in {} seconds (--precondition_max)", clock.s());
+		if (args->precondition_then == "wait") {
+			spdlog::info("precondition: entering wait mode");
+			args->update([this]{ args->wait = true; });
+		}
+		args->changed = true; // skip the stats of the interval with both workloads
+	}
+
+	void threadMain() noexcept {
+		DEBUG_MSG("monitor thread initiated");
+		const double round_s = args->precondition_round;
+		std::deque<Round> window;
+		uint32_t round = 0;
+		bool counting = false; // false for the partial round after the sequential pass
+
+		Stats last_stats, cur_stats;
+		std::unique_ptr<Latency> last_latency(new Latency()), cur_latency(new Latency());
+		stats.snapshot(last_stats);
+		stats.snapshot(*last_latency);
+
+		std::unique_lock<std::mutex> lock(stop_mutex);
+		while (!stop_ && phase != phase_done) {
+			stop_cv.wait_for(lock, std::chrono::seconds(args->precondition_round), [this]{ return stop_; });
+			if (stop_) break;
+
+			stats.snapshot(cur_stats);
+			stats.snapshot(*cur_latency);
+			if (phase == phase_random && counting && !args->wait) {
+				auto delta = cur_stats - last_stats;
+				auto lat   = cur_latency->write - last_latency->write;
+				window.push_back(Round{static_cast<double>(delta.blocks_write) / round_s, lat.mean() / 1000.0});
+				if (window.size() > args->precondition_window)
+					window.pop_front();
+				spdlog::info("precondition: round {}, write_iops={:.1f}, write_lat_avg_us={:.1f}",
+					++round, window.back().iops, window.back().lat_avg_us);
+
+				if (window.size() == args->precondition_window && steady(window, &Round::iops) && steady(window, &Round::lat_avg_us))
+					finish(true);
 			} else {
-				throw std::runtime_error(fmt::format("io_getevents returned error: {}:{}", nevents, E2S(nevents)).c_str());
+				window.clear(); // rounds in wait mode are not measured
 			}
-		} else if (nevents > 0) {
-			Stats stats_sum;
-			for (int i = 0; i < nevents; i++) {
-				if (events[i].data) {
-					auto req = ((AIORequest*) events[i].data);
-					assert(req->pos >= 0 && req->pos < max_iodepth);
-					req->request_finished();
-					stats_sum += req->stats;
+			counting = (phase == phase_random);
+
+			if (phase != phase_done && args->precondition_max > 0 && clock.s() >= args->precondition_max)
+				finish(false);
+
+			last_stats = cur_stats;
+			std::swap(last_latency, cur_latency);
+		}
+		DEBUG_MSG("monitor thread finished");
+	}
+
+	public: //---------------------------------------------------------------------
+	Preconditioner(Args* args_, StatsCollector& stats_, uint64_t size)
+		: args(args_), stats(stats_), block_size(args_->block_size * 1024), blocks(size / block_size)
+	{
+		DEBUG_MSG("constructor");
+		if (blocks == 0)
+			throw std::runtime_error("precondition: the block size is larger than the file");
+		spdlog::info("precondition: sequential write of {} MiB followed by random writes of {} KiB, rounds of {} seconds",
+			blocks * block_size / 1024 / 1024, block_size / 1024, args->precondition_round);
+		thread = std::thread( [this]{this->threadMain();} );
+	}
+
+	~Preconditioner() {
+		DEBUG_MSG("destructor");
+		{
+			std::lock_guard<std::mutex> lock(stop_mutex);
+			stop_ = true;
+			stop_cv.notify_all();
+		}
+		if (thread.joinable())
+			thread.join();
+	}
+
+	inline bool active() const {
+		return phase.load(std::memory_order_relaxed) != phase_done;
+	}
 
-					if (req->pos < iodepth)
-						req->request();
-				}
-			}
-			increment_stats(stats_sum);
+	const char* phase_str() const {
+		switch (phase.load(std::memory_order_relaxed)) {
+			case phase_fill:   return "fill";
+			case phase_random: return "random";
+			default:           return "done";
 		}
 	}
+
+	// Offset (logical address space) of the next preconditioning write.
+	uint64_t next_offset(Randomizer& r) {
+		if (phase.load(std::memory_order_relaxed) == phase_fill) {
+			auto b = fill_block.fetch_add(1, std::memory_order_relaxed);
+			if (b < blocks)
+				return b * block_size;
+			int expected = phase_fill;
+			if (phase.compare_exchange_strong(expected, phase_random))
+				spdlog::info("precondition: sequential write finished in {} seconds", clock.s());
+		}
+		return r.uniform(blocks) * block_size;
+	}
+
+	uint64_t size() const { return block_size; }
 };
 
 ////////////////////////////////////////////////////////////////////////////////////
 #undef __CLASS__
-#define __CLASS__ "Prwv2Engine::"
+#define __CLASS__ "Flusher::"
+
+// Flushes of the written data (--flush_blocks, --flush_method). A flush is
+// requested every --flush_blocks completed writes and runs in a dedicated
+// thread, so the engines never wait for it. Requests made while a flush is
+// running are coalesced into the next one. With --flush_method=dsync there is
+// no flush call: every --flush_blocks-th write is sent with RWF_DSYNC.
+class Flusher {
+	Args*                   args;
+	const std::vector<int>& fds;
+	StatsCollector&         stats;
+	const string            method;
+
+	std::atomic<uint64_t> writes {0};
+
+	std::thread             thread;
+	std::exception_ptr      thread_exception;
+	std::atomic<bool>       thread_failed {false};
+	std::mutex              mutex;
+	std::condition_variable cv;
+	uint64_t                requests = 0;
+	bool                    stop_ = false;
+
+	void sync(int fd) {
+		int ret;
+		if (method == "fsync")
+			ret = fsync(fd);
+		else if (method == "fdatasync")
+			ret = fdatasync(fd);
+		else // starts the write-back of the dirty pages without waiting, as RocksDB's bytes_per_sync
+			ret = sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+		if (ret != 0)
+			throw std::runtime_error(fmt::format("{} error: {}", method, strerror(errno)).c_str());
+	}
 
-class Prwv2Engine : public GenericEngine {
-	bool wait_ = true;
-	bool stop = false;
+	void threadMain() noexcept {
+		DEBUG_MSG("flusher thread initiated");
+		try {
+			auto cpu_guard = cpu_accounting.register_thread("flusher");
+			std::unique_lock<std::mutex> lock(mutex);
+			while (true) {
+				cv.wait(lock, [this]{ return stop_ || requests > 0; });
+				if (stop_) break;
+				requests = 0;
+				lock.unlock();
 
-	std::unique_ptr<std::unique_ptr<std::thread>[]> threads;
-	std::exception_ptr thread_exception;
+				auto begin = latency_clock::now();
+				for (auto fd: fds)
+					sync(fd);
+				stats.record_flush_latency(latency_ns(begin, latency_clock::now()));
 
-	int       fd;
-	uint32_t& iodepth;
+				lock.lock();
+			}
+		} catch (std::exception& e) {
+			DEBUG_MSG("exception received: {}", e.what());
+			thread_exception = std::current_exception();
+			thread_failed.store(true, std::memory_order_release);
+		}
+		DEBUG_MSG("flusher thread finished");
+	}
 
-	increment_stats_t  increment_stats;
-	access_params_t    access_params;
-	offset_released_t  offset_released;
+	// true every --flush_blocks calls
+	inline bool count_write() {
+		auto n = args->flush_blocks;
+		if (n == 0) return false;
+		return (writes.fetch_add(1, std::memory_order_relaxed) + 1) % n == 0;
+	}
 
 	public: //---------------------------------------------------------------------
-	Prwv2Engine(int fd_, uint32_t& iodepth_, increment_stats_t increment_stats_,
-	            access_params_t access_params_, offset_released_t offset_released_)
-	          : fd(fd_), iodepth(iodepth_), increment_stats(increment_stats_),
-	            access_params(access_params_),
-				offset_released(offset_released_)
+	Flusher(Args* args_, const std::vector<int>& fds_, StatsCollector& stats_)
+		: args(args_), fds(fds_), stats(stats_), method(args_->flush_method)
 	{
 		DEBUG_MSG("constructor");
-
-		threads.reset(new std::unique_ptr<std::thread>[max_iodepth]);
-		for (int i = 0; i < max_iodepth; i++) {
-			threads[i].reset(new std::thread( [this, i]{this->worker_thread(i);} ));
-		}
+		if (method != "dsync")
+			thread = std::thread( [this]{this->threadMain();} );
 	}
 
-	~Prwv2Engine() {
+	~Flusher() {
 		DEBUG_MSG("destructor");
-		stop = true;
-		for (int i = 0; i < max_iodepth; i++) {
-			if (threads[i]->joinable())
-				threads[i]->join();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop_ = true;
+			cv.notify_all();
 		}
-		threads.reset(nullptr);
+		if (thread.joinable())
+			thread.join();
 	}
 
-	bool is_multithread() {return true;}
-
-	void make_requests(bool& stop_) {
-		if (thread_exception) {
-			stop = true;
+	// Rethrows the errors of the flusher thread.
+	void check() const {
+		if (thread_failed.load(std::memory_order_acquire))
 			std::rethrow_exception(thread_exception);
-		}
+	}
 
-		if (stop != stop_)
-			stop = stop_;
-		if (wait_)
-			wait_ = false;
+	// Called when a write completes.
+	inline void written() {
+		if (method != "dsync" && count_write()) {
+			std::lock_guard<std::mutex> lock(mutex);
+			requests++;
+			cv.notify_one();
+		}
+	}
 
-		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	// Whether a new write must carry RWF_DSYNC (--flush_method=dsync).
+	inline bool dsync_write() {
+		return method == "dsync" && count_write();
 	}
+};
 
-	void wait() {
-		wait_ = true;
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "Discarder::"
+
+// Discards (--discard_ratio) run in a dedicated thread, so a large discard
+// never stalls the submission and the reaping of the engines: BLKDISCARD on
+// block devices and a punched hole on files. At most max_iodepth discards
+// wait to run; the ones requested while the queue is full are skipped.
+class Discarder {
+	const std::vector<int>&  fds;
+	const std::vector<bool>& block_devices;
+	StatsCollector&          stats;
+	Verifier*                verifier;
+	IOCapture*               capture;
+
+	std::thread              thread;
+	std::exception_ptr       thread_exception;
+	std::atomic<bool>        thread_failed {false};
+	std::mutex               mutex;
+	std::condition_variable  cv;
+	std::deque<AccessParams> pending;
+	uint64_t                 skipped = 0;
+	bool                     stop_ = false;
+
+	void discard(const AccessParams& p) {
+		int fd = fds[p.file];
+		auto submit_time = latency_clock::now();
+		if (block_devices[p.file]) {
+			uint64_t range[2] = {static_cast<uint64_t>(p.offset), p.size};
+			if (ioctl(fd, BLKDISCARD, &range) == -1)
+				throw std::runtime_error(fmt::format("BLKDISCARD error: {}", strerror(errno)).c_str());
+		} else {
+			if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, p.offset, p.size) == -1)
+				throw std::runtime_error(fmt::format("fallocate(PUNCH_HOLE) error: {}", strerror(errno)).c_str());
+		}
+		auto lat = latency_ns(submit_time, latency_clock::now());
+
+		if (verifier)
+			verifier->discarded(p.file, p.offset, p.size);
+		stats.increment(Stats{.blocks = 1, .blocks_discard = 1, .KB_discard = p.size / 1024});
+		stats.record_discard_latency(lat);
+		if (capture)
+			capture->record({false, p.file, p.offset, p.size, submit_time, lat, true});
 	}
 
-	void worker_thread(int pos) {
+	void threadMain() noexcept {
+		DEBUG_MSG("discarder thread initiated");
 		try {
-			size_t cur_size = -1;
-			std::unique_ptr<aligned_buffer_t[]> buffer_mem;
-			char* buffer = nullptr;
-			bool write = false;
-
-			while (!stop) {
-				while (!stop && wait_) {
-					std::this_thread::sleep_for(std::chrono::milliseconds(200));
-				}
-				if (stop) break;
-
-				if (pos < iodepth) {
-					auto params = access_params();
-
-					assert(params.size > 0);
-					if (cur_size != params.size) {
-						DEBUG_MSG("(posix thread[{}]) request size changed from {} to {}", pos, cur_size, params.size);
-						cur_size = params.size;
-						buffer_mem.reset(new aligned_buffer_t[cur_size/sizeof(aligned_buffer_t)]);
-						buffer = buffer_mem[0].data;
-						randomizer.randomize_buffer(buffer, cur_size);
-					} else if (params.write && write) { // randomize 5% of the buffer due to repeated writes
-						randomizer.randomize_buffer(buffer, cur_size, 20);
-					}
-
-					write = params.write;
-
-					iovec prw = { .iov_base = buffer, .iov_len = cur_size };
-					ssize_t ret;
+			auto cpu_guard = cpu_accounting.register_thread("discarder");
+			std::unique_lock<std::mutex> lock(mutex);
+			while (true) {
+				cv.wait(lock, [this]{ return stop_ || pending.size() > 0; });
+				if (stop_) break;
+				auto p = pending.front();
+				pending.pop_front();
+				lock.unlock();
 
-					if (params.write) {
-						ret = pwritev2(fd, &prw, 1, params.offset, params.dsync ? RWF_DSYNC : 0);
-					} else {
-						ret = preadv(fd, &prw, 1, params.offset);
-					}
+				discard(p);
 
-					if (stop) break;
-
-					offset_released(params.offset);
-
-					if (ret > 0) {
-						Stats st = {
-							.blocks = 1,
-							.blocks_read  = static_cast<uint64_t>( (!params.write) ? 1 : 0 ),
-							.blocks_write = static_cast<uint64_t>( ( params.write) ? 1 : 0 ),
-							.KB_read  = (!params.write) ? params.block_size : 0,
-							.KB_write = ( params.write) ? params.block_size : 0,
-						};
-						//DEBUG_MSG("st: KB_read={}, KB_write={}", st.KB_read, st.KB_write);
-						increment_stats(st);
-					} else if (ret == 0) {
-						spdlog::error("(posix thread[{}]) read/write returned zero", pos);
-					} else {
-						if (errno != EAGAIN && errno != EINTR)
-							throw std::runtime_error(fmt::format("(posix thread[{}]) read/write error: {}",
-									pos, alutils::strerror2(errno)).c_str());
-					}
-				} else {
-					std::this_thread::sleep_for(std::chrono::milliseconds(500));
-				}
+				lock.lock();
 			}
-		} catch (std::exception &e) {
-			DEBUG_MSG("(posix thread[{}]) exception received: {}", pos, e.what());
+		} catch (std::exception& e) {
+			DEBUG_MSG("exception received: {}", e.what());
 			thread_exception = std::current_exception();
+			thread_failed.store(true, std::memory_order_release);
 		}
+		DEBUG_MSG("discarder thread finished");
 	}
-};
-
-////////////////////////////////////////////////////////////////////////////////////
-#undef __CLASS__
-#define __CLASS__ "Lock::"
-
-class Lock {
-	bool active = false;
-	std::atomic_flag lock_flag = ATOMIC_FLAG_INIT;
 
 	public: //---------------------------------------------------------------------
+	Discarder(const std::vector<int>& fds_, const std::vector<bool>& block_devices_, StatsCollector& stats_,
+	          Verifier* verifier_, IOCapture* capture_)
+		: fds(fds_), block_devices(block_devices_), stats(stats_), verifier(verifier_), capture(capture_)
+	{
+		DEBUG_MSG("constructor");
+		thread = std::thread( [this]{this->threadMain();} );
+	}
 
-	Lock() {}
-	Lock(bool active_) : active(active_) {}
-	void activate() {active = true;}
+	~Discarder() {
+		DEBUG_MSG("destructor");
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop_ = true;
+			cv.notify_all();
+		}
+		if (thread.joinable())
+			thread.join();
+		if (skipped > 0)
+			spdlog::warn("{} discards skipped because {} were already waiting", skipped, max_iodepth);
+	}
 
-	// https://en.cppreference.com/w/cpp/atomic/atomic_flag
-	void lock() {
-		if (!active) return;
+	// Rethrows the errors of the discarder thread.
+	void check() const {
+		if (thread_failed.load(std::memory_order_acquire))
+			std::rethrow_exception(thread_exception);
+	}
 
-		while (lock_flag.test_and_set(std::memory_order_acquire)) {  // acquire lock
-#			if defined(__cpp_lib_atomic_flag_test)
-			while (lock_flag.test(std::memory_order_relaxed))        // test lock
-#			endif
-			{
-				std::this_thread::yield(); // yield
-			}
+	// Queues a discard. Returns false if it was skipped.
+	bool request(const AccessParams& p) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (pending.size() >= max_iodepth) {
+			skipped++;
+			return false;
 		}
-	}
-	void unlock() {
-		if (!active) return;
-		lock_flag.clear(std::memory_order_release);
+		if (verifier)
+			verifier->discarding(p.file, p.offset, p.size);
+		pending.push_back(p);
+		cv.notify_one();
+		return true;
 	}
 };
 
-
 ////////////////////////////////////////////////////////////////////////////////////
 #undef __CLASS__
 #define __CLASS__ "EngineController::"
 
 class EngineController {
 	Args*       args;
-	int         filed = -1;
+	std::vector<string>   filenames;
+	std::vector<int>      fds;
+	std::vector<uint64_t> file_sizes; // B
+	uint64_t              fs_block_size = 512;
+	std::vector<bool>     block_devices;
+	std::unique_ptr<StripeMap> stripe;
 
 	std::thread        thread;
 	std::exception_ptr thread_exception;
 	bool               stop_ = false;
 
-	public: //---------------------------------------------------------------------
-	Stats stats;
+	StatsCollector stats;
+	std::unique_ptr<Preconditioner> precondition;
+	std::unique_ptr<Flusher>        flusher;
+	std::unique_ptr<Discarder>      discarder;
+	std::unique_ptr<TraceReplay> trace;
+	std::unique_ptr<Verifier>    verifier;
+	std::unique_ptr<IOCapture>   capture;
 
-	EngineController(Args* args_) : args(args_) {
+	public: //---------------------------------------------------------------------
+	EngineController(Args* args_) : args(args_), seq_stream_per_thread(args_->seq_stream_select == "thread") {
 		DEBUG_MSG("constructor");
 		assert(args != nullptr);
 
+		buffer_pool.configure(args->buffer_pool_size * 1024 * 1024, args->buffer_hugepages);
+		data_pattern.configure(args->compress_ratio, args->dedup_ratio);
+
+		filenames = alutils::split_str(args->filename, ",");
+		if (filenames.size() == 0)
+			throw std::runtime_error("invalid --filename");
+
+		cpu_placement.configure(args->cpus, args->numa, filenames);
+		cpu_accounting.configure(args->cpu_stats);
+
 		if (args->create_file)
-			createFile();
+			for (auto& filename: filenames)
+				createFile(filename);
+
+		for (auto& filename: filenames)
+			openFile(filename);
+
+		stripe.reset(new StripeMap(file_sizes, args->stripe_size * 1024, fs_block_size, args->stripe_weights));
+		args->fs_block_size = fs_block_size;
+		args->address_space = stripe->size();
+		if (args->discard_ratio > 0.0)
+			args->validateDiscardSize(args->discard_size);
+		args->validateSizeMix(args->block_size_mix);
+		args->validateSizeMix(args->block_size_mix_write);
+
+		if (args->verify)
+			verifier.reset(new Verifier(file_sizes, randomizer.uniform(std::numeric_limits<uint64_t>::max())));
+
+		flusher.reset(new Flusher(args, fds, stats));
+
+		if (args->precondition)
+			precondition.reset(new Preconditioner(args, stats, stripe->size()));
+
+		if (args->trace_file != "")
+			trace.reset(new TraceReplay(*args, stripe->size()));
+
+		if (args->io_capture != "")
+			capture.reset(new IOCapture(args->io_capture, args->io_capture_ring));
 
-		openFile();
+		discarder.reset(new Discarder(fds, block_devices, stats, verifier.get(), capture.get()));
 
 		thread = std::thread( [this]{this->threadMain();} );
 	}
 
 	~EngineController() {
 		DEBUG_MSG("destructor");
-		stop_ = true;
+		stop();
 		if (thread.joinable())
 			thread.join();
-		if (filed >= 0) {
-			DEBUG_MSG("close file");
-			close(filed);
+		flusher.reset(nullptr); // before closing the files
+		discarder.reset(nullptr);
+		for (int i = 0; i < fds.size(); i++) {
+			DEBUG_MSG("close file {}", filenames[i]);
+			close(fds[i]);
 			if (args->create_file && args->delete_file) {
-				spdlog::info("delete file {}", args->filename);
-				std::remove(args->filename.c_str());
+				spdlog::info("delete file {}", filenames[i]);
+				std::remove(filenames[i].c_str());
 			}
 		}
 	}
 
 	bool isActive() {
 		if (thread_exception) std::rethrow_exception(thread_exception);
+		flusher->check();
+		discarder->check();
 		return !stop_;
 	}
 
 	void stop() noexcept {
-		stop_ = true;
+		{
+			std::lock_guard<std::mutex> lock(args->update_mutex);
+			stop_ = true;
+		}
+		args->update_cv.notify_all();
 	}
 
 	void wait(bool value=true) noexcept {
-		args->wait = value;
+		args->update([&]{ args->wait = value; });
+	}
+
+	void statsSnapshot(Stats& ret) const {
+		stats.snapshot(ret);
+	}
+
+	void latencySnapshot(Latency& ret) const {
+		stats.snapshot(ret);
+	}
+
+	void cpuSnapshot(CpuStats& ret) const {
+		cpu_accounting.snapshot(ret);
+	}
+
+	uint64_t captureDrops() const {
+		return capture ? capture->drops() : 0;
+	}
+
+	const char* preconditionPhase() const {
+		return precondition ? precondition->phase_str() : "";
 	}
 
 	private: //--------------------------------------------------------------------
 
-	void createFile() {
-		spdlog::info("creating file {}", args->filename);
+	// Reserves the space of the file with fallocate and, with --create_fill,
+	// writes fresh data (--compress_ratio/--dedup_ratio) from --create_threads
+	// threads, each one taking the next large chunk of the file in order.
+	void createFile(const string& filename) {
+		struct stat st;
+		if (stat(filename.c_str(), &st) == 0 && S_ISBLK(st.st_mode))
+			throw std::runtime_error(fmt::format("--create_file can't be used with the block device {}", filename).c_str());
 
-		const uint32_t buffer_size = 1024 * 1024;
-		alignas(aligned_buffer_size) char buffer[buffer_size];
-		randomizer.randomize_buffer(buffer, buffer_size);
+		const uint64_t file_size = args->filesize * 1024 * 1024;
+		spdlog::info("creating file {} ({} MiB, create_fill={}, create_threads={})", filename, args->filesize, args->create_fill, args->create_threads);
 
-		auto fd = open(args->filename.c_str(), O_CREAT|O_RDWR|O_DIRECT, 0640);
+		auto fd = open(filename.c_str(), O_CREAT|O_RDWR|O_DIRECT, 0640);
 		if (fd < 0)
-			throw std::runtime_error(fmt::format("can't create file: {}:{}", fd, E2S(fd)).c_str());
+			throw std::runtime_error(fmt::format("can't create file {}: {}", filename, strerror(errno)).c_str());
 		try {
-			size_t write_ret;
-			for (uint64_t i=0; i<args->filesize; i++) {
-				if ((write_ret = write(fd, buffer, buffer_size)) == -1) {
-					throw std::runtime_error(fmt::format("write error ({})", strerror(errno)));
-				}
+			if (fallocate(fd, 0, 0, file_size) != 0) {
+				if (errno != EOPNOTSUPP)
+					throw std::runtime_error(fmt::format("fallocate error ({})", strerror(errno)));
+				spdlog::warn("the file system of {} does not support fallocate, the space will not be reserved in advance", filename);
+				if (ftruncate(fd, file_size) != 0)
+					throw std::runtime_error(fmt::format("ftruncate error ({})", strerror(errno)));
 			}
+			if (args->create_fill)
+				fillFile(fd, file_size);
 			DEBUG_MSG("file created");
 		} catch (std::exception& e) {
 			close(fd);
-			std::remove(args->filename.c_str());
+			std::remove(filename.c_str());
 			throw std::runtime_error(fmt::format("create file error: {}", e.what()));
 		}
 		close(fd);
 	}
 
-	void checkFile() {
+	void fillFile(int fd, uint64_t file_size) {
+		const uint64_t chunk_size = 4 * 1024 * 1024;
+		const uint64_t n_chunks   = (file_size + chunk_size - 1) / chunk_size;
+		const uint32_t n_threads  = std::min<uint64_t>(args->create_threads, n_chunks);
+
+		std::atomic<uint64_t> next_chunk {0};
+		std::atomic<uint64_t> written {0}; // B
+		std::atomic<uint32_t> running {n_threads};
+		std::atomic<bool>     failed {false};
+		std::mutex            exception_mutex;
+		std::exception_ptr    exception;
+
+		auto worker = [&](uint32_t pos) noexcept {
+			try {
+				cpu_placement.pin(fmt::format("create[{}]", pos));
+				IOBuffer buffer_mem;
+				buffer_mem.reset(chunk_size);
+				char* buffer = buffer_mem.data();
+				uint64_t c;
+				while (!failed && (c = next_chunk.fetch_add(1)) < n_chunks) {
+					uint64_t offset = c * chunk_size;
+					size_t   size   = std::min(chunk_size, file_size - offset);
+					if (data_pattern.active())
+						data_pattern.fill(buffer, size, randomizer);
+					else
+						randomizer.randomize_buffer(buffer, size);
+					for (size_t done = 0; done < size;) {
+						auto ret = pwrite(fd, buffer + done, size - done, offset + done);
+						if (ret == -1 && errno == EINTR) continue;
+						if (ret <= 0)
+							throw std::runtime_error(fmt::format("write error ({})", ret == 0 ? "no space written" : strerror(errno)));
+						done += ret;
+					}
+					written.fetch_add(size, std::memory_order_relaxed);
+				}
+			} catch (std::exception& e) {
+				DEBUG_MSG("exception received: {}", e.what());
+				std::lock_guard<std::mutex> lock(exception_mutex);
+				if (!exception)
+					exception = std::current_exception();
+				failed = true;
+			}
+			running--;
+		};
+
+		std::vector<std::thread> threads;
+		for (uint32_t i = 0; i < n_threads; i++)
+			threads.emplace_back(worker, i);
+
+		Clock clock;
+		uint64_t last_report_ms = 0;
+		while (running > 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			auto ms = clock.ms();
+			if (ms - last_report_ms >= 5000) {
+				auto w = written.load(std::memory_order_relaxed);
+				spdlog::info("creating file: {:.1f}% ({} of {} MiB, {:.1f} MiB/s)",
+					static_cast<double>(w * 100) / static_cast<double>(file_size), w / 1024 / 1024, file_size / 1024 / 1024,
+					static_cast<double>(w * 1000) / static_cast<double>(ms * 1024 * 1024));
+				last_report_ms = ms;
+			}
+		}
+		for (auto& t: threads)
+			t.join();
+		if (exception)
+			std::rethrow_exception(exception);
+
+		if (fdatasync(fd) != 0)
+			throw std::runtime_error(fmt::format("fdatasync error ({})", strerror(errno)));
+		spdlog::info("file filled in {:.1f} seconds", static_cast<double>(clock.ms()) / 1000.0);
+	}
+
+	void checkFile(const string& filename, int fd) {
 		struct stat st;
 		DEBUG_MSG("get file stats");
-		if (stat(args->filename.c_str(), &st) == EOF)
-			throw std::runtime_error("can't read file stats");
+		if (fstat(fd, &st) == EOF)
+			throw std::runtime_error(fmt::format("can't read the stats of file {}", filename).c_str());
 		if ((args->block_size * 1024) % st.st_blksize != 0)
 			throw std::runtime_error("block size must be multiple of filesystem's block size");
-		if (!args->create_file) {
-			uint64_t size = st.st_size / 1024 / 1024;
-			spdlog::info("File already created. Set --filesize={}.", size);
+		fs_block_size = std::max<uint64_t>(fs_block_size, st.st_blksize);
+
+		uint64_t size_bytes = st.st_size;
+		block_devices.push_back(S_ISBLK(st.st_mode));
+		if (S_ISBLK(st.st_mode)) {
+			if (ioctl(fd, BLKGETSIZE64, &size_bytes) == -1)
+				throw std::runtime_error(fmt::format("can't read the size of block device {}: {}", filename, strerror(errno)).c_str());
+		}
+		if (args->create_file) {
+			size_bytes = args->filesize * 1024 * 1024;
+		} else {
+			uint64_t size = size_bytes / 1024 / 1024;
 			if (size < 10)
-				throw std::runtime_error("invalid --filesize");
-			args->filesize = size;
+				throw std::runtime_error(fmt::format("invalid size of file {}: {} MiB", filename, size).c_str());
+			if (file_sizes.size() == 0 || size < args->filesize) {
+				spdlog::info("File already created. Set --filesize={}.", size);
+				args->filesize = size;
+			}
 		}
+		file_sizes.push_back(size_bytes);
 	}
 
-	void openFile() {
+	void openFile(const string& filename) {
 		DEBUG_MSG("open file");
 
-		checkFile();
-
 		int flags = 0;
 		std::string flags_str;
 #		define useFlag(flagname) flags = flags|flagname; flags_str += fmt::format("{}{}", flags_str.length() == 0 ? "" : "|", #flagname)
 		useFlag(O_RDWR);
-		if (args->o_direct) {
+		if (args->o_direct && args->io_engine == "mmap") {
+			if (fds.size() == 0) spdlog::info("mmap engine uses the page cache, ignoring --o_direct");
+		} else if (args->o_direct) {
 			useFlag(O_DIRECT);
 		} else if (args->io_engine == "libaio") {
 			throw std::runtime_error("libaio engine only supports --o_direct=true (O_DIRECT)");
+		} else if (args->io_engine == "io_uring" && args->uring_iopoll) {
+			throw std::runtime_error("io_uring engine only supports --uring_iopoll=true with --o_direct=true (O_DIRECT)");
+		} else if (args->io_engine == "prwv2" && args->prwv2_hipri) {
+			throw std::runtime_error("prwv2 engine only supports --prwv2_hipri=true with --o_direct=true (O_DIRECT)");
 		}
 		if (args->io_engine == "posix" && args->o_dsync) {
 			useFlag(O_DSYNC);
 		}
 #		undef useFlag
 
-		spdlog::info("opening file '{}' with flags {}", args->filename, flags_str);
-		if (args->o_dsync && (args->io_engine == "libaio" || args->io_engine == "prwv2")) {
+		spdlog::info("opening file '{}' with flags {}", filename, flags_str);
+		if (args->o_dsync && fds.size() == 0 && (args->io_engine == "libaio" || args->io_engine == "io_uring" || args->io_engine == "prwv2")) {
 			spdlog::info("write requests will use flag RWF_DSYNC");
 		}
 
-		filed = open(args->filename.c_str(), flags, 0640);
-		if (filed < 0) {
-			throw std::runtime_error(fmt::format("can't open file: {}", filed, alutils::strerror2(errno)).c_str());
+		int fd = open(filename.c_str(), flags, 0640);
+		if (fd < 0) {
+			throw std::runtime_error(fmt::format("can't open file {}: {}", filename, alutils::strerror2(errno)).c_str());
 		}
+		fds.push_back(fd);
+
+		checkFile(filename, fd);
 	}
 
 	const uint32_t  random_scale = 10000;
@@ -730,33 +4705,158 @@ class EngineController {
 	Lock block_size_lock;
 	typeof(Args::block_size) cur_block_size  = 0;
 	uint64_t buffer_size = 0;
-	uint64_t file_blocks = 0;
-	uint64_t cur_block   = 0;
+	uint64_t unit_size   = 0; // B, gcd of the request sizes
+	uint64_t file_blocks = 0; // in units
+
+	// Sequential streams (--seq_streams), each one with its own region of
+	// the address space. With a single stream, random requests also move its
+	// cursor, so the sequential requests continue after them.
+	struct SeqStream {
+		uint64_t begin; // in units
+		uint64_t end;
+		uint64_t cur;
+		uint64_t units; // size of the last request
+	};
+	std::vector<SeqStream> streams;
+	const bool             seq_stream_per_thread;
+	uint32_t               next_stream = 0;
+	uint64_t discard_size = 0; // B, 0 while there are no discards
+
+	std::unique_ptr<SizeMix> read_mix;  // nullptr = block_size
+	std::unique_ptr<SizeMix> write_mix;
+	std::atomic<bool>        size_stats {false};
+
+	struct DistributionParams {
+		string block_size_mix;
+		string block_size_mix_write;
+		bool     discards;
+		uint64_t discard_size;
+		string distribution;
+		double zipf_theta;
+		bool   zipf_scrambled;
+		double hotspot_access;
+		double hotspot_size;
+		double hotspot_speed;
+		bool operator== (const DistributionParams& v) const {
+			return block_size_mix == v.block_size_mix && block_size_mix_write == v.block_size_mix_write &&
+			       discards == v.discards && discard_size == v.discard_size &&
+			       distribution == v.distribution && zipf_theta == v.zipf_theta && zipf_scrambled == v.zipf_scrambled &&
+			       hotspot_access == v.hotspot_access && hotspot_size == v.hotspot_size && hotspot_speed == v.hotspot_speed;
+		}
+	} cur_distribution_params;
+	std::unique_ptr<BlockDistribution> distribution;
+
+	struct RateParams {
+		double rate_iops;
+		double rate_mbps;
+		string rate_arrival;
+		bool operator== (const RateParams& v) const {
+			return rate_iops == v.rate_iops && rate_mbps == v.rate_mbps && rate_arrival == v.rate_arrival;
+		}
+	} cur_rate_params {0.0, 0.0, ""};
+	std::unique_ptr<RateScheduler> rate;
 
-	std::unique_ptr<std::uniform_int_distribution<uint64_t>> rand_block;
+	static constexpr uint64_t args_version_none = std::numeric_limits<uint64_t>::max();
+	uint64_t cur_args_version = args_version_none; // args->update_version applied
 
+	// Applies the parameters changed by commands. The strings are only copied
+	// when args->update_version changes, under args->update_mutex.
 	void check_arg_updates() {
-		if (cur_block_size != args->block_size) { // check block size
-			DEBUG_MSG("cur_block_size changed from {} to {}", cur_block_size, args->block_size);
+		if (args->update_version.load(std::memory_order_acquire) == cur_args_version)
+			return;
+		std::lock_guard<std::mutex> args_lock(args->update_mutex);
+		cur_args_version = args->update_version.load(std::memory_order_relaxed);
+
+		DistributionParams distribution_params {args->block_size_mix, args->block_size_mix_write,
+		                                        args->discard_ratio > 0.0, args->discard_size,
+		                                        args->distribution, args->zipf_theta, args->zipf_scrambled,
+		                                        args->hotspot_access, args->hotspot_size, args->hotspot_speed};
+
+		if (cur_block_size != args->block_size || !(cur_distribution_params == distribution_params)) {
+			DEBUG_MSG("cur_block_size changed from {} to {}, distribution: {}", cur_block_size, args->block_size, args->distribution);
 
 			block_size_lock.lock();
 
-			cur_block_size = args->block_size;
-			buffer_size = cur_block_size * 1024; // KiB to B;
-			file_blocks = (args->filesize * 1024) / cur_block_size;
-			cur_block = file_blocks; // seek 0 if next sequential I/O
+			try {
+				cur_block_size = args->block_size;
+				buffer_size = cur_block_size * 1024; // KiB to B;
+
+				read_mix.reset(args->block_size_mix != "" ? new SizeMix(args->block_size_mix, fs_block_size) : nullptr);
+				write_mix.reset(args->block_size_mix_write != "" ? new SizeMix(args->block_size_mix_write, fs_block_size) : nullptr);
+				if (!write_mix && read_mix)
+					write_mix.reset(new SizeMix(args->block_size_mix, fs_block_size));
+				size_stats = (read_mix || write_mix);
+
+				// offsets are multiples of the gcd of all request sizes, aligned to each request size
+				std::vector<uint64_t> sizes;
+				for (auto mix: {read_mix.get(), write_mix.get()}) {
+					if (mix) sizes.insert(sizes.end(), mix->all().begin(), mix->all().end());
+					else     sizes.push_back(buffer_size);
+				}
+				if (size_stats)
+					stats.set_size_classes(sizes);
+				const uint64_t max_size = *std::max_element(sizes.begin(), sizes.end()); // of the reads and writes
+				// the discards only take part in the units when they are sent
+				discard_size = 0;
+				if (distribution_params.discards) {
+					discard_size = (args->discard_size > 0) ? args->discard_size * 1024 : buffer_size;
+					if (discard_size % fs_block_size != 0)
+						throw std::runtime_error(fmt::format("discard size {} KiB is not a multiple of the file system block size", discard_size / 1024).c_str());
+					sizes.push_back(discard_size);
+				}
+				unit_size = 0;
+				for (auto i: sizes)
+					unit_size = std::gcd(unit_size, i);
+				file_blocks = stripe->size() / unit_size;
+				for (auto i: sizes) {
+					if (i / unit_size > file_blocks)
+						throw std::runtime_error(fmt::format("block size {} KiB is larger than the file", i / 1024).c_str());
+				}
+
+				// regions aligned to the largest request size
+				const uint64_t max_units = max_size / unit_size;
+				const uint64_t region = (file_blocks / args->seq_streams) / max_units * max_units;
+				if (region == 0)
+					throw std::runtime_error(fmt::format("--seq_streams={} is too large for the file size", args->seq_streams).c_str());
+				streams.clear();
+				for (uint32_t i = 0; i < args->seq_streams; i++) {
+					uint64_t end = (i + 1 == args->seq_streams) ? file_blocks : (i + 1) * region;
+					streams.push_back(SeqStream{i * region, end, end, 0}); // seek the beginning in the next request
+				}
+				next_stream = 0;
+
+				distribution.reset(BlockDistribution::create(*args, file_blocks));
+				cur_distribution_params = distribution_params;
+			} catch (...) {
+				block_size_lock.unlock();
+				throw;
+			}
+
+			block_size_lock.unlock();
+		}
 
-			rand_block.reset(new std::uniform_int_distribution<uint64_t>(0, file_blocks -1));
+		RateParams rate_params {args->rate_iops, args->rate_mbps, args->rate_arrival};
+		if (!(cur_rate_params == rate_params)) {
+			DEBUG_MSG("rate changed to rate_iops={}, rate_mbps={}, rate_arrival={}", args->rate_iops, args->rate_mbps, args->rate_arrival);
 
+			block_size_lock.lock();
+			if (rate_params.rate_iops > 0.0 || rate_params.rate_mbps > 0.0)
+				rate.reset(new RateScheduler(rate_params.rate_iops, rate_params.rate_mbps, rate_params.rate_arrival == "poisson"));
+			else
+				rate.reset(nullptr);
+			cur_rate_params = rate_params;
 			block_size_lock.unlock();
 		}
 	}
 
-	Lock                 increment_stats_lock;
-	increment_stats_t    increment_stats_lambda  = nullptr;
+	increment_stats_t        increment_stats_lambda  = nullptr;
+	register_latency_t       register_latency_lambda = nullptr;
+	register_fault_latency_t register_fault_latency_lambda = nullptr;
 
 	access_params_t      access_params_lambda    = nullptr;
 	offset_released_t    offset_released_lambda  = nullptr;
+	engine_failed_t      engine_failed_lambda    = nullptr;
+	bool                 engine_failed = false; // under args->update_mutex
 
 	void init_lambdas() {
 		DEBUG_MSG("initiating lambdas");
@@ -764,33 +4864,76 @@ class EngineController {
 
 		//-----------------------------------------------------
 		increment_stats_lambda = [this](const Stats& val)->void{
-			increment_stats_lock.lock();
-			stats += val;
-			//DEBUG_MSG("main stats: KB_read={}, KB_write={}", stats.KB_read, stats.KB_write);
-			increment_stats_lock.unlock();
+			stats.increment(val);
+		};
+
+		//-----------------------------------------------------
+		register_latency_lambda = [this](const IOCompletion& io)->void{
+			stats.record_latency(io.write, io.latency_ns);
+			if (size_stats.load(std::memory_order_relaxed))
+				stats.record_size_latency(io.size, io.latency_ns);
+			if (capture)
+				capture->record(io);
+			if (io.write)
+				flusher->written();
 		};
 
 		//-----------------------------------------------------
-		access_params_lambda = [this]()->AccessParams {
+		register_fault_latency_lambda = [this](uint64_t value_ns)->void{
+			stats.record_fault_latency(value_ns);
+		};
+
+		//-----------------------------------------------------
+		access_params_lambda = [this](uint32_t worker)->AccessParams {
 			AccessParams ret;
 
+			if (precondition && precondition->active()) {
+				return precondition_access_params();
+			}
+
+			if (trace) {
+				return trace_access_params();
+			}
+
+			while (args->discard_ratio > 0.0 && randomizer.randomize_ratio(args->discard_ratio) && !stop_)
+				discard_request();
+
 			ret.write = randomizer.randomize_ratio(args->write_ratio);
 
 			block_size_lock.lock();
 
-			ret.dsync      = args->o_dsync;
-			ret.block_size = cur_block_size;
-			ret.size       = buffer_size;
+			auto mix = ret.write ? write_mix.get() : read_mix.get();
+			ret.dsync      = args->o_dsync || (ret.write && flusher->dsync_write());
+			ret.size       = (mix != nullptr) ? mix->next(randomizer) : buffer_size;
+			ret.block_size = ret.size / 1024;
+			const uint64_t units = ret.size / unit_size;
 
+			uint64_t block;
 			if (randomizer.randomize_ratio(args->random_ratio)) { //random access
-				cur_block = (*rand_block)(randomizer.rand_eng64);
+				block = distribution->next(randomizer);
+				block -= block % units; // aligned to the request size
+				if (block + units > file_blocks)
+					block = (file_blocks / units - 1) * units;
+				if (streams.size() == 1) {
+					streams[0].cur   = block;
+					streams[0].units = units;
+				}
 			} else { //sequential access
-				cur_block++;
-				if (cur_block >= file_blocks) {
-					cur_block = 0;
+				auto& st = streams[sequential_stream(worker)];
+				st.cur += st.units;
+				if (st.cur + units > st.end) {
+					st.cur = st.begin;
 				}
+				st.units = units;
+				block = st.cur;
 			}
-			ret.offset = cur_block * buffer_size;
+			ret.offset = block * unit_size;
+			stripe->map(ret);
+
+			if (rate)
+				ret.intended_time = rate->next(ret.size, randomizer);
+			if (verifier)
+				ret.verify_tag = verifier->tag(ret);
 
 			block_size_lock.unlock();
 
@@ -800,73 +4943,191 @@ class EngineController {
 		//-----------------------------------------------------
 		offset_released_lambda = [this](long long offset)->void {};
 		//-----------------------------------------------------
+		engine_failed_lambda = [this]()->void {
+			{
+				std::lock_guard<std::mutex> lock(args->update_mutex);
+				engine_failed = true;
+			}
+			args->update_cv.notify_all();
+		};
+		//-----------------------------------------------------
+	}
+
+	// Stream of the next sequential request: the streams take turns per
+	// request (--seq_stream_select=request) or each engine worker keeps its
+	// own stream (thread). Called with block_size_lock.
+	uint32_t sequential_stream(uint32_t worker) {
+		if (streams.size() == 1)
+			return 0;
+		if (seq_stream_per_thread)
+			return worker % streams.size();
+		next_stream = (next_stream + 1) % streams.size();
+		return next_stream;
+	}
+
+	// Queues a discard (--discard_ratio) in the discarder thread, so it works
+	// the same with all engines. The offset follows --distribution, aligned to
+	// the discard size.
+	void discard_request() {
+		AccessParams p;
+		block_size_lock.lock();
+		if (discard_size == 0) { // discard_ratio set, not applied yet
+			block_size_lock.unlock();
+			return;
+		}
+		p.size = discard_size;
+		const uint64_t units = p.size / unit_size;
+		uint64_t block = distribution->next(randomizer);
+		block -= block % units;
+		if (block + units > file_blocks)
+			block = (file_blocks / units - 1) * units;
+		p.offset = block * unit_size;
+		stripe->map(p);
+		block_size_lock.unlock();
+
+		discarder->request(p);
+	}
+
+	AccessParams precondition_access_params() {
+		AccessParams ret;
+		ret.write      = true;
+		ret.dsync      = args->o_dsync || flusher->dsync_write();
+		ret.size       = precondition->size();
+		ret.block_size = ret.size / 1024;
+		ret.offset     = precondition->next_offset(randomizer);
+		stripe->map(ret);
+		if (verifier)
+			ret.verify_tag = verifier->tag(ret);
+		return ret;
+	}
+
+	AccessParams trace_access_params() {
+		TraceRecord rec;
+		latency_clock::time_point due_time;
+
+		if (! trace->next(rec, due_time)) {
+			stop();
+			return AccessParams(); // no request
+		}
+
+		AccessParams ret;
+		ret.write      = rec.write;
+		ret.dsync      = args->o_dsync || (ret.write && flusher->dsync_write());
+		ret.block_size = rec.size / 1024;
+		ret.size       = rec.size;
+		ret.offset     = rec.offset;
+		stripe->map(ret);
+		if (verifier)
+			ret.verify_tag = verifier->tag(ret);
+
+		if (args->trace_speed > 0.0)
+			ret.intended_time = due_time; // the engines send it then
+
+		return ret;
 	}
 
 	void threadMain() noexcept {
 		spdlog::info("initiating worker thread");
 		try {
+			cpu_placement.pin("controller");
+			auto cpu_guard = cpu_accounting.register_thread("controller");
 			init_lambdas();
 
-			uint64_t flush_count = 0;
-			uint64_t last_writes = 0;
-
 			std::unique_ptr<GenericEngine> engine;
 
 			spdlog::info("using {} engine", args->io_engine);
 			if (args->io_engine == "posix") {
 				engine.reset(new PosixEngine(
-				                      filed,
+				                      fds,
 				                      increment_stats_lambda,
+				                      register_latency_lambda,
 				                      access_params_lambda,
-				                      offset_released_lambda));
+				                      offset_released_lambda,
+				                      verifier.get()));
+			} else if (args->io_engine == "mmap") {
+				engine.reset(new MmapEngine(
+				                      fds,
+				                      file_sizes,
+				                      args->mmap_advice,
+				                      increment_stats_lambda,
+				                      register_latency_lambda,
+				                      register_fault_latency_lambda,
+				                      access_params_lambda,
+				                      offset_released_lambda,
+				                      verifier.get()));
 			} else if (args->io_engine == "libaio") {
 				engine.reset(new AIOEngine(
-				                      filed,
+				                      fds,
+				                      args->iodepth,
+				                      args->aio_threads,
+				                      args->aio_user_reap,
+				                      increment_stats_lambda,
+				                      register_latency_lambda,
+				                      access_params_lambda,
+				                      offset_released_lambda,
+				                      verifier.get(),
+				                      engine_failed_lambda));
+			} else if (args->io_engine == "io_uring") {
+				engine.reset(new UringEngine(
+				                      fds,
 				                      args->iodepth,
+				                      args->uring_sqpoll,
+				                      args->uring_iopoll,
 				                      increment_stats_lambda,
+				                      register_latency_lambda,
 				                      access_params_lambda,
-				                      offset_released_lambda));
+				                      offset_released_lambda,
+				                      verifier.get()));
 			} else if (args->io_engine == "prwv2") {
 				engine.reset(new Prwv2Engine(
-				                      filed,
+				                      fds,
 				                      args->iodepth,
+				                      args->prwv2_hipri,
+				                      args->prwv2_nowait,
 				                      increment_stats_lambda,
+				                      register_latency_lambda,
 				                      access_params_lambda,
-				                      offset_released_lambda));
+				                      offset_released_lambda,
+				                      verifier.get(),
+				                      engine_failed_lambda));
 			} else {
 				throw std::runtime_error("invalid or not implemented engine");
 			}
 
 			if (engine->is_multithread()) {
-				increment_stats_lock.activate();
 				block_size_lock.activate();
 			}
 
+			// Commands, stop() and failures of the engine threads are notified
+			// through args->update_cv.
 			while (!stop_) {
-				if (args->wait)
+				if (args->wait) {
 					spdlog::info("engine controller thread in wait mode");
-				while (!stop_ && args->wait) {
 					engine->wait();
-					std::this_thread::sleep_for(std::chrono::milliseconds(200));
+					if (trace) trace->pause();
+					{
+						std::unique_lock<std::mutex> lock(args->update_mutex);
+						args->update_cv.wait(lock, [this]{ return stop_ || engine_failed || !args->wait; });
+					}
+					if (stop_) break;
 					if (! args->wait) {
 						spdlog::info("exit wait mode");
-						break;
+						cur_rate_params = RateParams{0.0, 0.0, ""}; // restart the open-loop schedule
+						cur_args_version = args_version_none;
 					}
 				}
-				if (stop_) break;
+				if (trace) trace->resume();
 
 				check_arg_updates();
 
 				engine->make_requests(stop_);
 
-				if (!stop_ && args->flush_blocks) {
-					auto cur_blocks_write = stats.blocks_write;
-					if ((cur_blocks_write - last_writes) >= args->flush_blocks) {
-						fdatasync(filed);
-					}
-					last_writes = cur_blocks_write;
+				if (engine->is_multithread()) { // the engine threads make the requests
+					std::unique_lock<std::mutex> lock(args->update_mutex);
+					args->update_cv.wait(lock, [this]{
+						return stop_ || engine_failed || args->update_version.load(std::memory_order_relaxed) != cur_args_version;
+					});
 				}
-
 			} // while (!stop_)
 
 		} catch (std::exception &e) {
@@ -1023,6 +5284,114 @@ class Reader {
 	}
 };
 
+////////////////////////////////////////////////////////////////////////////////////
+#undef __CLASS__
+#define __CLASS__ "LatencyTuner::"
+
+// --latency_target: adjusts iodepth once per stats interval, looking for the
+// highest throughput whose latency percentile (reads and writes) stays under
+// the target:
+//   ramp:   doubles the depth while the target is met and the throughput grows;
+//   search: bisects between the last depth that met the target and the first
+//           one that missed it;
+//   steady: keeps the depth, stepping down when the target is missed and
+//           probing one step up after some intervals with margin.
+class LatencyTuner {
+	static constexpr double   min_gain        = 1.02; // ramp: throughput gain worth a deeper queue
+	static constexpr double   probe_margin    = 0.8;  // steady: fraction of the target that allows a probe
+	static constexpr uint32_t probe_intervals = 3;
+
+	enum Phase {ramp, search, steady};
+
+	const uint64_t target_ns;
+	const double   percentile;
+
+	Phase    phase = ramp;
+	uint32_t depth;
+	uint32_t low;       // deepest depth known to meet the target (0 = none)
+	uint32_t high;      // shallowest depth known to miss the target
+	double   low_mbps;
+	uint32_t good_intervals;
+	uint64_t last_latency = 0;
+
+	void settle(uint32_t depth_) {
+		phase = steady;
+		depth = std::max<uint32_t>(1, depth_);
+		good_intervals = 0;
+	}
+
+	public: //---------------------------------------------------------------------
+	LatencyTuner(uint64_t target_us, double percentile_) : target_ns(target_us * 1000), percentile(percentile_) {
+		restart(1);
+	}
+
+	// Starts a new search from depth_ (e.g. after the command iodepth).
+	void restart(uint32_t depth_) {
+		phase = ramp;
+		depth = depth_;
+		low = 0;
+		high = max_iodepth + 1;
+		low_mbps = 0.0;
+		good_intervals = 0;
+	}
+
+	uint32_t iodepth() const { return depth; }
+
+	// Evaluates the last interval, ran with iodepth(), and returns the depth of
+	// the next one.
+	uint32_t update(const Histogram& latency, double mbps) {
+		if (latency.count == 0) // nothing to evaluate (e.g. wait=true)
+			return depth;
+
+		last_latency = latency.percentile(percentile);
+		bool ok = last_latency <= target_ns;
+
+		switch (phase) {
+			case ramp:
+				if (!ok) {
+					high = depth;
+					if (low == 0 || high - low <= 1) settle(low);
+					else { phase = search; depth = (low + high) / 2; }
+				} else if (mbps < low_mbps * min_gain) { // saturated: a deeper queue only adds latency
+					settle(low);
+				} else {
+					low = depth;
+					low_mbps = mbps;
+					if (depth >= max_iodepth) settle(depth);
+					else depth = std::min<uint32_t>(max_iodepth, depth * 2);
+				}
+				break;
+			case search:
+				if (ok) { low = depth; low_mbps = std::max(low_mbps, mbps); }
+				else    high = depth;
+				if (high - low <= 1) settle(low);
+				else depth = (low + high) / 2;
+				break;
+			case steady:
+				if (!ok) {
+					settle(depth - std::max<uint32_t>(1, depth / 8));
+				} else if (last_latency < target_ns * probe_margin && depth < max_iodepth) {
+					if (++good_intervals >= probe_intervals) {
+						depth++;
+						good_intervals = 0;
+					}
+				} else {
+					good_intervals = 0;
+				}
+				break;
+		}
+		return depth;
+	}
+
+	// STATS fields
+	std::string str_stat() const {
+		static const char* phase_str[] = {"ramp", "search", "steady"};
+		return fmt::format(", \"tuner\":\"{}\"", phase_str[phase]) +
+		       fmt::format(", \"tuner_lat_p{}_us\":\"{:.1f}\"", percentile, static_cast<double>(last_latency) / 1000.0) +
+		       fmt::format(", \"tuner_iodepth\":\"{}\"", depth);
+	}
+};
+
 ////////////////////////////////////////////////////////////////////////////////////
 #undef __CLASS__
 #define __CLASS__ "Program::"
@@ -1032,6 +5401,7 @@ class Program {
 	std::unique_ptr<Args>   args;
 	std::unique_ptr<EngineController> engine_controller;
 	std::unique_ptr<Reader> reader;
+	std::unique_ptr<LatencyTuner> latency_tuner;
 
 	Clock execution_clock;
 
@@ -1064,6 +5434,11 @@ class Program {
 
 			engine_controller.reset(new EngineController(args.get()));
 			reader.reset(new Reader(args.get()));
+			if (args->latency_target > 0) {
+				latency_tuner.reset(new LatencyTuner(args->latency_target, args->latency_percentile));
+				args->update([this]{ args->iodepth = latency_tuner->iodepth(); });
+				spdlog::info("latency_target: p{} <= {}us, starting with iodepth {}", args->latency_percentile, args->latency_target, args->iodepth);
+			}
 			report_thread = std::thread([this](){ reportThreadMain(); });
 
 			Defer df1([this]{ resetAll(); });
@@ -1114,7 +5489,14 @@ class Program {
 			uint64_t stats_interval_us = args->stats_interval * 1000000;
 			uint64_t last_ms = 0;
 
-			auto elapsed_stats = engine_controller->stats;
+			Stats elapsed_stats;
+			engine_controller->statsSnapshot(elapsed_stats);
+			std::unique_ptr<Latency> elapsed_latency(new Latency());
+			std::unique_ptr<Latency> cur_latency(new Latency());
+			engine_controller->latencySnapshot(*elapsed_latency);
+			uint64_t elapsed_drops = engine_controller->captureDrops();
+			CpuStats elapsed_cpu;
+			engine_controller->cpuSnapshot(elapsed_cpu);
 			args->changed = true;
 
 			while (!stop_) {
@@ -1130,7 +5512,12 @@ class Program {
 				correction_clock.reset();
 
 				auto cur_ms = execution_clock.ms();
-				auto cur_stats = engine_controller->stats;
+				Stats cur_stats;
+				engine_controller->statsSnapshot(cur_stats);
+				engine_controller->latencySnapshot(*cur_latency);
+				uint64_t cur_drops = engine_controller->captureDrops();
+				CpuStats cur_cpu;
+				engine_controller->cpuSnapshot(cur_cpu);
 
 				//DEBUG_MSG("cur_stats: KB_read={}, KB_write={}", cur_stats.KB_read, cur_stats.KB_write);
 				if (! args->changed) {
@@ -1146,14 +5533,100 @@ class Program {
 						fmt::format(", \"write_MiB/s\":\"{:.2f}\"", static_cast<double>(delta.KB_write * 1000)/static_cast<double>(elapsed_ms * 1024) ) +
 						fmt::format(", \"blocks/s\":\"{:.1f}\"",    static_cast<double>(delta.blocks   * 1000)/static_cast<double>(elapsed_ms) ) +
 						fmt::format(", \"blocks_read/s\":\"{:.1f}\"",  static_cast<double>(delta.blocks_read  * 1000)/static_cast<double>(elapsed_ms) ) +
-						fmt::format(", \"blocks_write/s\":\"{:.1f}\"", static_cast<double>(delta.blocks_write * 1000)/static_cast<double>(elapsed_ms) ) ;
+						fmt::format(", \"blocks_write/s\":\"{:.1f}\"", static_cast<double>(delta.blocks_write * 1000)/static_cast<double>(elapsed_ms) ) +
+						(cur_latency->read  - elapsed_latency->read ).str_stat("read") +
+						(cur_latency->write - elapsed_latency->write).str_stat("write") ;
+					if (args->io_engine == "mmap") {
+						aux_str +=
+							fmt::format(", \"faults_major/s\":\"{:.1f}\"", static_cast<double>(delta.faults_major * 1000)/static_cast<double>(elapsed_ms) ) +
+							fmt::format(", \"faults_minor/s\":\"{:.1f}\"", static_cast<double>(delta.faults_minor * 1000)/static_cast<double>(elapsed_ms) ) +
+							(cur_latency->fault - elapsed_latency->fault).str_stat("fault");
+					}
+					if (args->verify) {
+						aux_str +=
+							fmt::format(", \"verify_ok\":\"{}\"",      delta.verify_ok) +
+							fmt::format(", \"verify_unknown\":\"{}\"", delta.verify_unknown) +
+							fmt::format(", \"verify_errors\":\"{}\"",  delta.verify_errors);
+					}
+					if (args->discard_ratio > 0.0) {
+						aux_str +=
+							fmt::format(", \"discard_MiB/s\":\"{:.2f}\"", static_cast<double>(delta.KB_discard * 1000)/static_cast<double>(elapsed_ms * 1024) ) +
+							fmt::format(", \"blocks_discard/s\":\"{:.1f}\"", static_cast<double>(delta.blocks_discard * 1000)/static_cast<double>(elapsed_ms) ) +
+							(cur_latency->discard - elapsed_latency->discard).str_stat("discard");
+					}
+					if (args->flush_blocks > 0 && args->flush_method != "dsync") {
+						auto h = cur_latency->flush - elapsed_latency->flush;
+						aux_str +=
+							fmt::format(", \"flushes/s\":\"{:.1f}\"", static_cast<double>(h.count * 1000)/static_cast<double>(elapsed_ms) ) +
+							h.str_stat("flush");
+					}
+					if (args->precondition)
+						aux_str += fmt::format(", \"precondition\":\"{}\"", engine_controller->preconditionPhase());
+					if (args->io_capture != "")
+						aux_str += fmt::format(", \"capture_drops\":\"{}\"", cur_drops - elapsed_drops);
+					bool size_mix;
+					{
+						std::lock_guard<std::mutex> lock(args->update_mutex);
+						size_mix = (args->block_size_mix != "" || args->block_size_mix_write != "");
+					}
+					if (size_mix) {
+						for (uint32_t c = 0; c < max_size_classes; c++) {
+							auto size = cur_latency->size_class[c];
+							if (size == 0) continue;
+							auto h = cur_latency->size_latency[c] - elapsed_latency->size_latency[c];
+							auto prefix = fmt::format("bs{}K", size / 1024);
+							aux_str +=
+								fmt::format(", \"{}_blocks/s\":\"{:.1f}\"", prefix, static_cast<double>(h.count * 1000)/static_cast<double>(elapsed_ms) ) +
+								fmt::format(", \"{}_MiB/s\":\"{:.2f}\"",    prefix, static_cast<double>(h.count * size * 1000)/static_cast<double>(elapsed_ms * 1024 * 1024) ) +
+								h.str_stat(prefix.c_str());
+						}
+					}
+					if (cpu_accounting.enabled()) {
+						auto cpu = cur_cpu - elapsed_cpu;
+						double ios = std::max<double>(1.0, delta.blocks);
+						aux_str +=
+							fmt::format(", \"cpu_us/io\":\"{:.2f}\"",  static_cast<double>(cpu.user_us + cpu.sys_us)/ios ) +
+							fmt::format(", \"cpu_user_%\":\"{:.1f}\"", static_cast<double>(cpu.user_us * 100)/static_cast<double>(elapsed_ms * 1000) ) +
+							fmt::format(", \"cpu_sys_%\":\"{:.1f}\"",  static_cast<double>(cpu.sys_us  * 100)/static_cast<double>(elapsed_ms * 1000) ) +
+							fmt::format(", \"cpu_io_threads_%\":\"{:.1f}\"", static_cast<double>(cpu.io_threads_us * 100)/static_cast<double>(elapsed_ms * 1000) ) +
+							fmt::format(", \"ctx_voluntary/s\":\"{:.1f}\"",   static_cast<double>(cpu.ctx_voluntary   * 1000)/static_cast<double>(elapsed_ms) ) +
+							fmt::format(", \"ctx_involuntary/s\":\"{:.1f}\"", static_cast<double>(cpu.ctx_involuntary * 1000)/static_cast<double>(elapsed_ms) );
+						if (cpu_accounting.perf()) {
+							aux_str +=
+								fmt::format(", \"task_clock_us/io\":\"{:.2f}\"", static_cast<double>(cpu.task_clock_ns)/(ios * 1000.0) ) +
+								fmt::format(", \"ctx_switches/s\":\"{:.1f}\"",   static_cast<double>(cpu.ctx_switches * 1000)/static_cast<double>(elapsed_ms) ) +
+								fmt::format(", \"cycles/io\":\"{:.0f}\"",        static_cast<double>(cpu.cycles)/ios ) +
+								fmt::format(", \"instructions/io\":\"{:.0f}\"",  static_cast<double>(cpu.instructions)/ios ) +
+								fmt::format(", \"ipc\":\"{:.2f}\"", (cpu.cycles > 0) ? static_cast<double>(cpu.instructions)/static_cast<double>(cpu.cycles) : 0.0 );
+						}
+					}
+					if (latency_tuner) {
+						auto h = cur_latency->read - elapsed_latency->read;
+						h += cur_latency->write - elapsed_latency->write;
+						auto old_depth = args->iodepth;
+						auto new_depth = latency_tuner->update(h, static_cast<double>((delta.KB_read + delta.KB_write) * 1000)/static_cast<double>(elapsed_ms * 1024));
+						aux_str += latency_tuner->str_stat();
+						if (new_depth != old_depth) {
+							// same path of the command iodepth, but without args->changed:
+							// the tuner reports its own decisions in every interval
+							args->update([&]{ args->iodepth = new_depth; });
+							DEBUG_MSG("latency_target: iodepth {} -> {}", old_depth, new_depth);
+						}
+					}
 					spdlog::info("STATS: {{{}, {}}}", aux_str, aux_args);
 
 				} else { // args changed. skip stats for one period
 					args->changed = false;
+					if (latency_tuner && latency_tuner->iodepth() != args->iodepth) {
+						spdlog::info("latency_target: iodepth set to {} by command, restarting the search", args->iodepth);
+						latency_tuner->restart(args->iodepth);
+					}
 				}
 
 				elapsed_stats = cur_stats;
+				elapsed_drops = cur_drops;
+				elapsed_cpu = cur_cpu;
+				std::swap(elapsed_latency, cur_latency);
 				last_ms = cur_ms;
 			}
 		} catch (const std::exception& e) {
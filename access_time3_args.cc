@@ -46,6 +46,16 @@ static void setLogLevel(const string& value) {
 	loglevel.set(value);
 }
 
+static string parseString(const string& value, bool required) {
+	if (required && value.length() == 0)
+		throw invalid_argument("empty value");
+	return value;
+}
+
+static string parseOptionalString(const string& value, bool required) {
+	return value;
+}
+
 ALL_ARGS_F( declareFlag );
 
 ////////////////////////////////////////////////////////////////////////////////////
@@ -116,8 +126,16 @@ Args::Args(int argc, char** argv) {
 		o_dsync = true;
 	}
 
-	if (io_engine == "posix" && iodepth > 1) {
-		throw invalid_argument("io_engine posix only supports iodepth 1");
+	if ((io_engine == "posix" || io_engine == "mmap") && iodepth > 1) {
+		throw invalid_argument(format("io_engine {} only supports iodepth 1", io_engine));
+	}
+
+	if (seq_stream_select == "thread" && (io_engine == "posix" || io_engine == "mmap")) {
+		throw invalid_argument(format("seq_stream_select=thread needs several workers, not supported by io_engine {}", io_engine));
+	}
+
+	if (latency_target > 0 && (io_engine == "posix" || io_engine == "mmap")) {
+		throw invalid_argument(format("latency_target is not supported by io_engine {}", io_engine));
 	}
 
 	if (FLAGS_log_level == "debug") {
@@ -128,16 +146,30 @@ Args::Args(int argc, char** argv) {
 }
 
 string Args::strStat() {
+	std::lock_guard<std::mutex> lock(update_mutex);
 	string ret;
 
 #	define addArgStr(name) ret += fmt::format("{}\"{}\":\"{}\"", (ret.length()>0) ?", " :"", #name, name)
 	addArgStr(wait);
 	addArgStr(filesize);
 	addArgStr(block_size);
+	addArgStr(block_size_mix);
+	addArgStr(block_size_mix_write);
 	addArgStr(iodepth);
 	addArgStr(flush_blocks);
 	addArgStr(write_ratio);
 	addArgStr(random_ratio);
+	addArgStr(discard_ratio);
+	addArgStr(discard_size);
+	addArgStr(rate_iops);
+	addArgStr(rate_mbps);
+	addArgStr(rate_arrival);
+	addArgStr(distribution);
+	addArgStr(zipf_theta);
+	addArgStr(zipf_scrambled);
+	addArgStr(hotspot_access);
+	addArgStr(hotspot_size);
+	addArgStr(hotspot_speed);
 #	undef addArgStr
 
 	return ret;
@@ -151,6 +183,48 @@ void Args::executeCommand(const string& command_line) {
 #undef DEBUG_F
 #define DEBUG_F oc.print_debug
 
+// discard_size (KiB, 0 = block_size) against the opened files.
+void Args::validateDiscardSize(uint64_t value) const {
+	const uint64_t size = ((value > 0) ? value : block_size) * 1024;
+	const uint64_t fs_block = fs_block_size.load();
+	const uint64_t space    = address_space.load();
+	if (fs_block > 0 && size % fs_block != 0)
+		throw invalid_argument(format("discard_size {} KiB is not a multiple of the file system block size ({} B)", size / 1024, fs_block));
+	if (space > 0 && size > space)
+		throw invalid_argument(format("discard_size {} KiB is larger than the file ({} KiB)", size / 1024, space / 1024));
+}
+
+// "<KiB>:<weight>,..." to the sizes (B) with a positive weight.
+std::vector<std::pair<uint64_t, double>> Args::parseSizeMix(const string& spec, uint64_t fs_block_size) {
+	std::vector<std::pair<uint64_t, double>> ret;
+	for (auto& i: alutils::split_str(spec, ",")) {
+		auto aux = alutils::split_str(i, ":");
+		if (aux.size() != 2)
+			throw invalid_argument(format("invalid block size mix: \"{}\"", spec));
+		uint64_t size = std::stoull(aux[0]) * 1024;
+		double weight = std::stod(aux[1]);
+		if (size < 4096 || size % fs_block_size != 0)
+			throw invalid_argument(format("block size {} KiB of the mix must be multiple of filesystem's block size", size / 1024));
+		if (weight <= 0.0)
+			continue;
+		ret.push_back({size, weight});
+	}
+	if (ret.size() == 0)
+		throw invalid_argument(format("invalid block size mix: \"{}\"", spec));
+	return ret;
+}
+
+// block_size_mix / block_size_mix_write (empty = none) against the opened files.
+void Args::validateSizeMix(const string& spec) const {
+	const uint64_t fs_block = fs_block_size.load();
+	const uint64_t space    = address_space.load();
+	if (spec == "" || fs_block == 0) return;
+	for (auto& i: parseSizeMix(spec, fs_block)) {
+		if (space > 0 && i.first > space)
+			throw invalid_argument(format("block size {} KiB of the mix is larger than the file ({} KiB)", i.first / 1024, space / 1024));
+	}
+}
+
 void Args::executeCommand(const string& command_line, OutputController& oc) {
 	DEBUG_MSG("command_line: \"{}\"", command_line);
 
@@ -164,18 +238,32 @@ void Args::executeCommand(const string& command_line, OutputController& oc) {
 				"    stop           - terminate\n"
 				"    wait           - (true|false)\n"
 				"    block_size     - [4..]\n"
+				"    block_size_mix - <KiB>:<weight>,... (empty = block_size)\n"
+				"    block_size_mix_write - <KiB>:<weight>,... (empty = block_size_mix)\n"
 				"    iodepth        - [1..{}]\n"
 				"    write_ratio    - [0..1]\n"
 				"    random_ratio   - [0..1]\n"
+				"    discard_ratio  - [0..1)\n"
+				"    discard_size   - [0|4..] (KiB, 0 = block_size)\n"
 				"    flush_blocks   - [0..]\n"
+				"    rate_iops      - [0..] (0 = closed loop)\n"
+				"    rate_mbps      - [0..] (0 = closed loop)\n"
+				"    rate_arrival   - (constant|poisson)\n"
+				"    distribution   - (uniform|zipfian|hotspot|moving_hotspot)\n"
+				"    zipf_theta     - (0..100]\n"
+				"    zipf_scrambled - (true|false)\n"
+				"    hotspot_access - [0..1]\n"
+				"    hotspot_size   - (0..1]\n"
+				"    hotspot_speed  - [0..]\n"
 				, max_iodepth);
 		return;
 	}
 
 #	define parseLineCommand(name, parser, required, default_) \
 		if (command == #name) { \
-				name = parser(value, required, default_, "invalid value for the command " #name); \
-				oc.print_info("set {}={}", command, name); \
+				auto aux = parser(value, required, default_, "invalid value for the command " #name); \
+				update([&]{ name = aux; }); \
+				oc.print_info("set {}={}", command, aux); \
 				return; \
 		}
 #	define parseLineCommandValidate(name, parser, immutable_condition) \
@@ -183,17 +271,35 @@ void Args::executeCommand(const string& command_line, OutputController& oc) {
 				if (immutable_condition) throw invalid_argument("parameter " #name " is immutable due to condition: " #immutable_condition); \
 				auto aux = parser(value, true); \
 				validate_##name(command.c_str(), aux); \
-				name = aux; \
+				update([&]{ name = aux; changed = true; }); \
 				oc.print_info("set {}={}", command, aux); \
-				changed = true; \
 				return; \
 		}
 	parseLineCommand(wait, alutils::parseBool, false, true);
 	parseLineCommandValidate(block_size, alutils::parseUint64, false);
-	parseLineCommandValidate(iodepth, alutils::parseUint32, io_engine == "posix");
+	if (command == "block_size_mix" || command == "block_size_mix_write")
+		validateSizeMix(value);
+	parseLineCommandValidate(block_size_mix, parseOptionalString, false);
+	parseLineCommandValidate(block_size_mix_write, parseOptionalString, false);
+	parseLineCommandValidate(iodepth, alutils::parseUint32, io_engine == "posix" || io_engine == "mmap");
 	parseLineCommandValidate(write_ratio, alutils::parseDouble, false);
 	parseLineCommandValidate(random_ratio, alutils::parseDouble, false);
+	if (command == "discard_ratio" && alutils::parseDouble(value, true) > 0.0)
+		validateDiscardSize(discard_size);
+	parseLineCommandValidate(discard_ratio, alutils::parseDouble, false);
+	if (command == "discard_size")
+		validateDiscardSize(alutils::parseUint64(value, true));
+	parseLineCommandValidate(discard_size, alutils::parseUint64, false);
 	parseLineCommand(flush_blocks, alutils::parseUint64, true, 0);
+	parseLineCommandValidate(rate_iops, alutils::parseDouble, false);
+	parseLineCommandValidate(rate_mbps, alutils::parseDouble, false);
+	parseLineCommandValidate(rate_arrival, parseString, false);
+	parseLineCommandValidate(distribution, parseString, false);
+	parseLineCommandValidate(zipf_theta, alutils::parseDouble, false);
+	parseLineCommandValidate(zipf_scrambled, alutils::parseBool, false);
+	parseLineCommandValidate(hotspot_access, alutils::parseDouble, false);
+	parseLineCommandValidate(hotspot_size, alutils::parseDouble, false);
+	parseLineCommandValidate(hotspot_speed, alutils::parseDouble, false);
 #	undef parseLineCommand
 #	undef parseLineCommandValidate
 
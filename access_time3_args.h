@@ -7,7 +7,11 @@
 
 #include <string>
 #include <deque>
+#include <vector>
+#include <utility>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <functional>
 
 #include <spdlog/spdlog.h>
@@ -45,7 +49,7 @@ const uint32_t max_iodepth = 128;
 		nullptr)                                                  \
 	_f(filename, string, DEFINE_string,                           \
 		"",                                                       \
-		"file name",                                              \
+		"file name (a comma-separated list stripes the accesses over the files or block devices)", \
 		value.length() != 0,                                      \
 		nullptr)                                                  \
 	_f(create_file, bool, DEFINE_bool,                            \
@@ -58,31 +62,148 @@ const uint32_t max_iodepth = 128;
 		"delete file if created",                                 \
 		true,                                                     \
 		nullptr)                                                  \
+	_f(create_fill, bool, DEFINE_bool,                            \
+		true,                                                     \
+		"--create_file: write data in the whole file (false = only reserve the space with fallocate, unwritten extents are read as zeros without device I/O)", \
+		true,                                                     \
+		nullptr)                                                  \
+	_f(create_threads, uint32_t, DEFINE_uint32,                   \
+		4,                                                        \
+		"--create_file: threads writing the file",                \
+		value >= 1 && value <= 64,                                \
+		nullptr)                                                  \
 	_f(filesize, uint64_t, DEFINE_uint64,                         \
 		0,                                                        \
 		"file size (MiB)",                                        \
 		value >= 10 || !FLAGS_create_file,                        \
 		nullptr)                                                  \
+	_f(stripe_size, uint64_t, DEFINE_uint64,                      \
+		1024,                                                     \
+		"multiple files: stripe unit (KiB, multiple of 4)",       \
+		value >= 4 && value % 4 == 0,                             \
+		nullptr)                                                  \
+	_f(stripe_weights, string, DEFINE_string,                     \
+		"",                                                       \
+		"multiple files: comma-separated stripe units per file in each stripe row (empty = 1 for all)", \
+		std::regex_match(value, std::regex("([1-9][0-9]*(,[1-9][0-9]*)*)?")), \
+		nullptr)                                                  \
 	_f(io_engine, string, DEFINE_string,                          \
 		"posix",                                                  \
-		"I/O engine (posix,prwv2,libaio)",                        \
-		value == "posix" || value == "prwv2" || value == "libaio",\
+		"I/O engine (posix,prwv2,libaio,io_uring,mmap)",          \
+		value == "posix" || value == "prwv2" || value == "libaio" \
+		  || value == "io_uring" || value == "mmap",              \
+		nullptr)                                                  \
+	_f(mmap_advice, string, DEFINE_string,                        \
+		"normal",                                                 \
+		"mmap: madvise hint for the mappings (normal,random,sequential,willneed)", \
+		value == "normal" || value == "random"                    \
+		  || value == "sequential" || value == "willneed",        \
+		nullptr)                                                  \
+	_f(uring_sqpoll, bool, DEFINE_bool,                           \
+		false,                                                    \
+		"io_uring: use a kernel thread to poll the submission queue (IORING_SETUP_SQPOLL)", \
+		true,                                                     \
+		nullptr)                                                  \
+	_f(uring_iopoll, bool, DEFINE_bool,                           \
+		false,                                                    \
+		"io_uring: busy-poll for completions (IORING_SETUP_IOPOLL, requires O_DIRECT)", \
+		true,                                                     \
+		nullptr)                                                  \
+	_f(prwv2_hipri, bool, DEFINE_bool,                            \
+		false,                                                    \
+		"prwv2: polled completions (RWF_HIPRI, requires O_DIRECT and NVMe poll queues)", \
+		true,                                                     \
+		nullptr)                                                  \
+	_f(prwv2_nowait, bool, DEFINE_bool,                           \
+		false,                                                    \
+		"prwv2: send the requests with RWF_NOWAIT first, again without it when they would block", \
+		true,                                                     \
+		nullptr)                                                  \
+	_f(cpus, string, DEFINE_string,                               \
+		"",                                                       \
+		"CPUs of the engine threads, one per thread in turn, e.g. 0-3,8 (empty = no pinning)", \
+		std::regex_match(value, std::regex("([0-9]+(-[0-9]+)?(,[0-9]+(-[0-9]+)?)*)?")), \
+		nullptr)                                                  \
+	_f(numa, string, DEFINE_string,                               \
+		"none",                                                   \
+		"NUMA node of the engine threads and I/O buffers (none, device: node of the device of --filename, or a node number)", \
+		std::regex_match(value, std::regex("none|device|[0-9]+")), \
+		nullptr)                                                  \
+	_f(aio_threads, uint32_t, DEFINE_uint32,                      \
+		1,                                                        \
+		"libaio: submitter/reaper threads, each one with its own context and share of iodepth", \
+		value > 0 && value <= 64,                                 \
+		nullptr)                                                  \
+	_f(aio_user_reap, bool, DEFINE_bool,                          \
+		false,                                                    \
+		"libaio: reap the completions from the aio ring in user space (no io_getevents)", \
+		true,                                                     \
 		nullptr)                                                  \
 	_f(iodepth, uint32_t, DEFINE_uint32,                          \
 		1,                                                        \
 		"iodepth",                                                \
 		value > 0 && value <= max_iodepth,                        \
 		nullptr)                                                  \
+	_f(latency_target, uint64_t, DEFINE_uint64,                   \
+		0,                                                        \
+		"adjust iodepth for the highest throughput with the latency percentile under this target (us, 0 = disabled)", \
+		true,                                                     \
+		nullptr)                                                  \
+	_f(latency_percentile, double, DEFINE_double,                 \
+		99.0,                                                     \
+		"--latency_target: latency percentile of reads and writes", \
+		value > 0.0 && value <= 100.0,                            \
+		nullptr)                                                  \
+	_f(buffer_pool_size, uint64_t, DEFINE_uint64,                 \
+		4096,                                                     \
+		"address space reserved for the I/O buffers (MiB)",       \
+		value >= 16,                                              \
+		nullptr)                                                  \
+	_f(buffer_hugepages, string, DEFINE_string,                   \
+		"none",                                                   \
+		"huge pages for the I/O buffers (none,thp,hugetlb)",      \
+		value == "none" || value == "thp" || value == "hugetlb",  \
+		nullptr)                                                  \
 	_f(block_size, uint64_t, DEFINE_uint64,                       \
 		4,                                                        \
 		"block size (KiB)",                                       \
 		value >= 4,                                               \
 		nullptr)                                                  \
+	_f(block_size_mix, string, DEFINE_string,                     \
+		"",                                                       \
+		"weighted request sizes, e.g. 4:70,64:20,1024:10 (<KiB>:<weight>, empty = --block_size)", \
+		std::regex_match(value, std::regex("([0-9]+:[0-9]+(\\.[0-9]+)?(,[0-9]+:[0-9]+(\\.[0-9]+)?)*)?")), \
+		nullptr)                                                  \
+	_f(block_size_mix_write, string, DEFINE_string,               \
+		"",                                                       \
+		"weighted sizes of the write requests (empty = --block_size_mix)", \
+		std::regex_match(value, std::regex("([0-9]+:[0-9]+(\\.[0-9]+)?(,[0-9]+:[0-9]+(\\.[0-9]+)?)*)?")), \
+		nullptr)                                                  \
+	_f(verify, bool, DEFINE_bool,                                 \
+		false,                                                    \
+		"write a header and CRC32C in each 4 KiB sector and verify them on reads", \
+		true,                                                     \
+		nullptr)                                                  \
+	_f(compress_ratio, double, DEFINE_double,                     \
+		1.0,                                                      \
+		"target compression ratio of the written data (1 = incompressible)", \
+		value >= 1.0,                                             \
+		nullptr)                                                  \
+	_f(dedup_ratio, double, DEFINE_double,                        \
+		1.0,                                                      \
+		"target deduplication ratio of the written 4 KiB chunks (1 = unique)", \
+		value >= 1.0,                                             \
+		nullptr)                                                  \
 	_f(flush_blocks, uint64_t, DEFINE_uint64,                     \
 		0,                                                        \
-		"blocks written before a fdatasync (0 = no flush)",       \
+		"blocks written between flushes (see --flush_method, 0 = no flush)", \
 		true,                                                     \
 		nullptr)                                                  \
+	_f(flush_method, string, DEFINE_string,                       \
+		"fdatasync",                                              \
+		"--flush_blocks: fsync, fdatasync, sync_file_range (start the write-back only) or dsync (RWF_DSYNC in the write)", \
+		value == "fsync" || value == "fdatasync" || value == "sync_file_range" || value == "dsync", \
+		nullptr)                                                  \
 	_f(write_ratio, double, DEFINE_double,                        \
 		0.0,                                                      \
 		"writes/reads ratio (0-1)",                               \
@@ -93,6 +214,142 @@ const uint32_t max_iodepth = 128;
 		"random ratio (0-1)",                                     \
 		value >= 0.0 && value <= 1.0,                             \
 		nullptr)                                                  \
+	_f(discard_ratio, double, DEFINE_double,                      \
+		0.0,                                                      \
+		"ratio of discards among the requests (0-1): BLKDISCARD on block devices, hole punch on files", \
+		value >= 0.0 && value < 1.0,                              \
+		nullptr)                                                  \
+	_f(discard_size, uint64_t, DEFINE_uint64,                     \
+		0,                                                        \
+		"size of the discards (KiB, 0 = --block_size)",           \
+		value == 0 || value >= 4,                                 \
+		nullptr)                                                  \
+	_f(seq_streams, uint32_t, DEFINE_uint32,                      \
+		1,                                                        \
+		"independent sequential streams, each one in its own region of the file", \
+		value >= 1 && value <= 1024,                              \
+		nullptr)                                                  \
+	_f(seq_stream_select, string, DEFINE_string,                  \
+		"request",                                                \
+		"--seq_streams: streams take turns per request (request) or are pinned to the engine workers: prwv2 threads, libaio/io_uring request slots (thread)", \
+		value == "request" || value == "thread",                  \
+		nullptr)                                                  \
+	_f(rate_iops, double, DEFINE_double,                          \
+		0.0,                                                      \
+		"open-loop mode: send requests at this rate (IOPS, 0 = closed loop)", \
+		value >= 0.0,                                             \
+		nullptr)                                                  \
+	_f(rate_mbps, double, DEFINE_double,                          \
+		0.0,                                                      \
+		"open-loop mode: send requests at this rate (MiB/s, 0 = closed loop)", \
+		value >= 0.0,                                             \
+		nullptr)                                                  \
+	_f(rate_arrival, string, DEFINE_string,                       \
+		"constant",                                               \
+		"open-loop mode: inter-arrival times (constant,poisson)", \
+		value == "constant" || value == "poisson",                \
+		nullptr)                                                  \
+	_f(distribution, string, DEFINE_string,                       \
+		"uniform",                                                \
+		"distribution of the random accesses (uniform,zipfian,hotspot,moving_hotspot)", \
+		value == "uniform" || value == "zipfian"                  \
+		  || value == "hotspot" || value == "moving_hotspot",     \
+		nullptr)                                                  \
+	_f(zipf_theta, double, DEFINE_double,                         \
+		0.99,                                                     \
+		"zipfian: skew parameter (theta > 0)",                    \
+		value > 0.0 && value <= 100.0,                            \
+		nullptr)                                                  \
+	_f(zipf_scrambled, bool, DEFINE_bool,                         \
+		true,                                                     \
+		"zipfian: spread the hottest blocks over the file",       \
+		true,                                                     \
+		nullptr)                                                  \
+	_f(hotspot_access, double, DEFINE_double,                     \
+		0.8,                                                      \
+		"hotspot: ratio of the random accesses to the hotspot (0-1)", \
+		value >= 0.0 && value <= 1.0,                             \
+		nullptr)                                                  \
+	_f(hotspot_size, double, DEFINE_double,                       \
+		0.2,                                                      \
+		"hotspot: size of the hotspot as a ratio of the file size (0-1)", \
+		value > 0.0 && value <= 1.0,                              \
+		nullptr)                                                  \
+	_f(hotspot_speed, double, DEFINE_double,                      \
+		0.01,                                                     \
+		"moving_hotspot: ratio of the file the hotspot moves per second", \
+		value >= 0.0,                                             \
+		nullptr)                                                  \
+	_f(trace_file, string, DEFINE_string,                         \
+		"",                                                       \
+		"replay the requests of a trace file instead of generating them", \
+		value == "" || std::filesystem::exists(value),            \
+		nullptr)                                                  \
+	_f(trace_format, string, DEFINE_string,                       \
+		"fio",                                                    \
+		"format of --trace_file (fio: iolog v2/v3, blkparse: blkparse text output)", \
+		value == "fio" || value == "blkparse",                    \
+		nullptr)                                                  \
+	_f(trace_speed, double, DEFINE_double,                        \
+		1.0,                                                      \
+		"trace replay speed relative to the recorded timestamps (0 = as fast as possible)", \
+		value >= 0.0,                                             \
+		nullptr)                                                  \
+	_f(trace_loop, bool, DEFINE_bool,                             \
+		false,                                                    \
+		"restart the trace replay at the end of the trace file",  \
+		true,                                                     \
+		nullptr)                                                  \
+	_f(trace_extent, uint64_t, DEFINE_uint64,                     \
+		0,                                                        \
+		"address space of the trace, rescaled to --filesize (MiB, 0 = scan the trace)", \
+		true,                                                     \
+		nullptr)                                                  \
+	_f(precondition, bool, DEFINE_bool,                           \
+		false,                                                    \
+		"write preconditioning (sequential pass + random writes of --block_size) until steady state, before the workload", \
+		true,                                                     \
+		nullptr)                                                  \
+	_f(precondition_round, uint32_t, DEFINE_uint32,               \
+		60,                                                       \
+		"--precondition: duration of each random write round (seconds)", \
+		value > 0,                                                \
+		nullptr)                                                  \
+	_f(precondition_window, uint32_t, DEFINE_uint32,              \
+		5,                                                        \
+		"--precondition: rounds in the steady state window",      \
+		value >= 3,                                               \
+		nullptr)                                                  \
+	_f(precondition_excursion, double, DEFINE_double,             \
+		0.2,                                                      \
+		"--precondition: max range of write IOPS and latency in the window, relative to the average", \
+		value > 0.0,                                              \
+		nullptr)                                                  \
+	_f(precondition_slope, double, DEFINE_double,                 \
+		0.1,                                                      \
+		"--precondition: max excursion of the least squares line in the window, relative to the average", \
+		value > 0.0,                                              \
+		nullptr)                                                  \
+	_f(precondition_max, uint32_t, DEFINE_uint32,                 \
+		0,                                                        \
+		"--precondition: give up after this time (seconds, 0 = no limit)", \
+		true,                                                     \
+		nullptr)                                                  \
+	_f(precondition_then, string, DEFINE_string,                  \
+		"run",                                                    \
+		"--precondition: what to do at the steady state (run: start the workload, wait: enter wait mode)", \
+		value == "run" || value == "wait",                        \
+		nullptr)                                                  \
+	_f(io_capture, string, DEFINE_string,                         \
+		"",                                                       \
+		"record every I/O request in this binary file (decoded by access_time3_capture.py)", \
+		true,                                                     \
+		nullptr)                                                  \
+	_f(io_capture_ring, uint64_t, DEFINE_uint64,                  \
+		65536,                                                    \
+		"--io_capture: records buffered per thread (power of 2), records are dropped when it is full", \
+		value >= 1024 && (value & (value - 1)) == 0,              \
+		nullptr)                                                  \
 	_f(direct_io, bool, DEFINE_bool,                              \
 		false,                                                    \
 		"same that -o_direct -o_dsync (backward compatibility)",  \
@@ -108,6 +365,11 @@ const uint32_t max_iodepth = 128;
 		"use O_DSYNC",                                            \
 		true,                                                     \
 		nullptr)                                                  \
+	_f(cpu_stats, string, DEFINE_string,                          \
+		"rusage",                                                 \
+		"CPU usage of the engine threads in STATS (none, rusage, perf: rusage and perf_event counters)", \
+		value == "none" || value == "rusage" || value == "perf",  \
+		nullptr)                                                  \
 	_f(stats_interval, uint32_t, DEFINE_uint32,                   \
 		5,                                                        \
 		"Statistics interval (seconds)",                          \
@@ -203,13 +465,38 @@ class OutputController {
 struct Args {
 	bool changed = false;
 
+	// Parameters changed at runtime (executeCommand) are written under
+	// update_mutex, followed by update_version++ and update_cv.notify_all().
+	// Threads reading the string parameters take update_mutex.
+	std::mutex              update_mutex;
+	std::condition_variable update_cv;
+	std::atomic<uint64_t>   update_version {0};
+
+	template<typename F>
+	void update(F f) {
+		{
+			std::lock_guard<std::mutex> lock(update_mutex);
+			f();
+			update_version++;
+		}
+		update_cv.notify_all();
+	}
+
 #	define declareArg(ARG_name, ARG_type, ...) ARG_type ARG_name;
 	ALL_ARGS_F( declareArg );
 #	undef declareArg
 
+	// Set by the engine controller once the files are open, to validate the
+	// commands (0 = unknown).
+	std::atomic<uint64_t>   fs_block_size {0}; // B
+	std::atomic<uint64_t>   address_space {0}; // B
+
 	Args(int argc, char** argv);
 	void executeCommand(const string& command_line);
 	void executeCommand(const string& command_line, OutputController& oc);
+	void validateDiscardSize(uint64_t value) const;
+	void validateSizeMix(const string& spec) const;
+	static std::vector<std::pair<uint64_t, double>> parseSizeMix(const string& spec, uint64_t fs_block_size);
 	string strStat();
 };
 
@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""
+@author: Adriano Lange <alange0001@gmail.com>
+
+Copyright (c) 2020-present, Adriano Lange.  All rights reserved.
+This source code is licensed under both the GPLv2 (found in the
+LICENSE file in the root directory) and Apache 2.0 License
+(found in the LICENSE.Apache file in the root directory).
+
+Decoder of the binary I/O capture of access_time3 (--io_capture).
+The output is CSV with one request per line, e.g.:
+    access_time3_capture.py --sort capture.bin > capture.csv
+"""
+
+import sys
+import struct
+import argparse
+import traceback
+
+# =============================================================================
+import logging
+log = logging.getLogger('access_time3_capture')
+log.setLevel(logging.INFO)
+
+
+# =============================================================================
+class ArgsWrapper:  # single global instance of "args"
+	def get_args(self):
+		parser = argparse.ArgumentParser(
+			description="decoder of the binary I/O capture of access_time3 (--io_capture)")
+		parser.add_argument('-l', '--log_level', type=str,
+			default='INFO', choices=[ 'debug', 'DEBUG', 'info', 'INFO' ],
+			help='Log level.')
+		parser.add_argument('--output', type=str,
+			default='',
+			help='Output CSV file (default: stdout).')
+		parser.add_argument('--sort', default=False, action='store_true',
+			help='Sort the requests by submission time (the capture is in flush order).')
+		parser.add_argument('--epoch', default=False, action='store_true',
+			help='Print wall clock timestamps (ns since the epoch) instead of relative times.')
+		parser.add_argument('capture_file', type=str,
+			help='File created by access_time3 --io_capture.')
+
+		args = parser.parse_args()
+
+		log_h = logging.StreamHandler()
+		log_h.setFormatter(logging.Formatter('%(levelname)s: %(message)s'))
+		log.addHandler(log_h)
+		log.setLevel(getattr(logging, args.log_level.upper()))
+
+		log.debug(f'Args: {str(args)}')
+
+		return args
+
+	def __getattr__(self, name):
+		global args
+		args = self.get_args()
+		return getattr(args, name)
+
+
+args = ArgsWrapper()
+
+
+# =============================================================================
+# Must match IOCaptureHeader and IOCaptureRecord in access_time3.cc.
+HEADER = struct.Struct('<8sIIQQ')  # magic, version, record_size, start_epoch_ns, reserved
+RECORD = struct.Struct('<QQQIHBB') # time_ns, offset, latency_ns, size, thread, file, op
+MAGIC = b'AT3CAPT\0'
+VERSION = 1
+OPS = ('read', 'write', 'discard')
+COLUMNS = ('time_ns', 'thread', 'file', 'op', 'offset', 'size', 'latency_ns')
+
+
+class CaptureFile:
+	def __init__(self, filename):
+		self.filename = filename
+		with open(filename, 'rb') as f:
+			header = f.read(HEADER.size)
+		if len(header) < HEADER.size:
+			raise Exception(f'{filename} is too small to be a capture file')
+		magic, self.version, self.record_size, self.start_epoch_ns, _ = HEADER.unpack(header)
+		if magic != MAGIC:
+			raise Exception(f'{filename} is not a capture file of access_time3')
+		if self.version != VERSION or self.record_size != RECORD.size:
+			raise Exception(f'unsupported capture file version {self.version} (record size {self.record_size})')
+		log.debug(f'capture file {filename}: version {self.version}, start_epoch_ns {self.start_epoch_ns}')
+
+	def records(self, chunk_records=64 * 1024):
+		with open(self.filename, 'rb') as f:
+			f.seek(HEADER.size)
+			while True:
+				data = f.read(chunk_records * RECORD.size)
+				if len(data) % RECORD.size != 0:
+					log.warning(f'ignoring a truncated record at the end of {self.filename}')
+					data = data[:len(data) - len(data) % RECORD.size]
+				if len(data) == 0:
+					break
+				yield from RECORD.iter_unpack(data)
+
+
+def write_csv(capture, output):
+	records = capture.records()
+	if args.sort:
+		records = sorted(records, key=lambda r: r[0])
+	time_base = capture.start_epoch_ns if args.epoch else 0
+	output.write(','.join(COLUMNS) + '\n')
+	count = 0
+	for time_ns, offset, latency_ns, size, thread, file, op in records:
+		output.write(f'{time_base + time_ns},{thread},{file},{OPS[op]},{offset},{size},{latency_ns}\n')
+		count += 1
+	log.debug(f'{count} records decoded')
+
+
+def main() -> int:
+	try:
+		capture = CaptureFile(args.capture_file)
+		if args.output in ['', 'stdout']:
+			write_csv(capture, sys.stdout)
+		else:
+			with open(args.output, 'wt') as f:
+				write_csv(capture, f)
+
+	except Exception as e:
+		if log.level == logging.DEBUG:
+			exc_type, exc_value, exc_traceback = sys.exc_info()
+			sys.stderr.write('main exception:\n' +
+			                 ''.join(traceback.format_exception(exc_type, exc_value, exc_traceback)) + '\n')
+		else:
+			sys.stderr.write(str(e) + '\n')
+		return 1
+	return 0
+
+
+# =============================================================================
+if __name__ == '__main__':
+	exit(main())